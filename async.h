@@ -0,0 +1,121 @@
+// Parse JSON that arrives a piece at a time, in coroutines.
+#ifndef PME_JSON_ASYNC_H
+#define PME_JSON_ASYNC_H
+
+#include <pull.h>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <string>
+
+namespace JSON {
+
+/*
+ * A coroutine that runs as soon as it's called, until it first suspends.
+ * Nothing waits for it: whatever resumes it owns it until it finishes, when
+ * it cleans up after itself. If it ends with an exception, that's left in
+ * error() for whoever started it, rather than escaping from whatever
+ * happened to resume it.
+ */
+struct Task {
+    struct Outcome {
+        std::exception_ptr error;
+    };
+    std::shared_ptr<Outcome> outcome;
+
+    struct promise_type {
+        std::shared_ptr<Outcome> outcome = std::make_shared<Outcome>();
+        Task get_return_object() { return Task{ outcome }; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { outcome->error = std::current_exception(); }
+    };
+
+    std::exception_ptr error() const { return outcome ? outcome->error : nullptr; }
+};
+
+/*
+ * A PullParser over input that's fed to it as it arrives. A coroutine
+ * takes events with "co_await parser.next(event)", which suspends it if the
+ * input runs dry part way through one; feed() resumes it once there's enough
+ * to go on. So one thread can parse any number of streams at their own
+ * pace, with a coroutine each, holding no more of each than an unfinished
+ * token. An event's text lasts until the parser is next fed or awaited.
+ *
+ * If the parser goes away while its coroutine is waiting, it destroys the
+ * coroutine.
+ */
+class AsyncParser {
+    std::string buf; // what we've been fed and not yet parsed.
+    bool complete = false;
+    PullParser parser;
+    Event *pending = nullptr; // where the waiting coroutine wants its event.
+    bool result = false;
+    std::coroutine_handle<> waiting;
+
+    bool attempt(Event &event) {
+        result = parser.next(event);
+        return result || !parser.starved();
+    }
+    void wake() {
+        if (waiting && attempt(*pending)) {
+            auto coroutine = waiting;
+            waiting = nullptr;
+            coroutine.resume();
+        }
+    }
+
+public:
+    AsyncParser() : parser(std::string_view(), false) {}
+    AsyncParser(const AsyncParser &) = delete;
+    AsyncParser &operator=(const AsyncParser &) = delete;
+    ~AsyncParser() {
+        if (waiting)
+            waiting.destroy();
+    }
+
+    // Start on a new stream, dropping any coroutine still waiting on this one.
+    void reset() {
+        if (waiting)
+            waiting.destroy();
+        waiting = nullptr;
+        pending = nullptr;
+        buf.clear();
+        complete = false;
+        parser.reset(std::string_view(), false);
+    }
+
+    void feed(std::string_view data) {
+        buf.erase(0, parser.used());
+        buf.append(data);
+        parser.refill(buf, complete);
+        wake();
+    }
+
+    // There's no more input to come.
+    void finish() {
+        complete = true;
+        feed(std::string_view());
+    }
+
+    struct Next {
+        AsyncParser &self;
+        Event &event;
+        bool await_ready() { return self.attempt(event); }
+        void await_suspend(std::coroutine_handle<> coroutine) {
+            self.pending = &event;
+            self.waiting = coroutine;
+        }
+        bool await_resume() const { return self.result; }
+    };
+
+    // Like PullParser::next, but waits for input rather than starving.
+    Next next(Event &event) { return Next{ *this, event }; }
+
+    // For failed(), error() and depth().
+    const PullParser &pull() const { return parser; }
+};
+
+}
+#endif
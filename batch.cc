@@ -0,0 +1,217 @@
+// Indent many files in one process, named by a list rather than the command line.
+#include <jdent.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+struct Job {
+    string name;
+    string output; // formatted text, when writing a combined stream.
+    string error;
+};
+
+static string
+indentFile(istream &in, ostream &out)
+{
+    string error = indentDocument(in, out);
+    return error.empty() ? error : "invalid JSON: " + error;
+}
+
+// Serve a job from the cache, returning false if it has to be formatted directly.
+static bool
+cachedJob(Job &job, const BatchOptions &opts)
+{
+    int fd = opts.cache->get(job.name.c_str(), job.error);
+    if (fd == -1)
+        return !job.error.empty();
+    if (opts.suffix.empty()) {
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            job.output.resize(st.st_size);
+            if (pread(fd, &job.output[0], st.st_size, 0) != st.st_size)
+                job.error = string("failed reading cache entry: ") + strerror(errno);
+        }
+    } else {
+        string outName = job.name + opts.suffix;
+        int out = open(outName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (out == -1) {
+            job.error = "failed to open " + outName + ": " + strerror(errno);
+        } else {
+            if (!copyFd(fd, out))
+                job.error = "failed writing " + outName + ": " + strerror(errno);
+            close(out);
+        }
+    }
+    close(fd);
+    return true;
+}
+
+static void
+runJob(Job &job, const BatchOptions &opts)
+{
+    if (opts.cache && cachedJob(job, opts))
+        return;
+    ifstream in(job.name);
+    if (!in.good()) {
+        job.error = string("failed to open: ") + strerror(errno);
+        return;
+    }
+    if (opts.suffix.empty()) {
+        ostringstream out;
+        job.error = indentFile(in, out);
+        if (job.error.empty())
+            job.output = out.str();
+        return;
+    }
+    string outName = job.name + opts.suffix;
+    ofstream out(outName, ios::trunc);
+    if (!out.good()) {
+        job.error = "failed to open " + outName + ": " + strerror(errno);
+        return;
+    }
+    job.error = indentFile(in, out);
+    out.close();
+    if (job.error.empty() && !out)
+        job.error = "failed writing " + outName + ": " + strerror(errno);
+    if (!job.error.empty())
+        unlink(outName.c_str());
+}
+
+}
+
+/*
+ * Names are read a window at a time and the window's files spread across the
+ * worker threads. Output for the combined stream is collected per file, and
+ * written in list order once the window is done, so a file that fails part
+ * way through leaves nothing behind.
+ */
+bool
+indentFiles(ostream &out, const BatchOptions &opts)
+{
+    ifstream listFile;
+    istream *list = &cin;
+    if (strcmp(opts.list, "-") != 0) {
+        listFile.open(opts.list);
+        if (!listFile.good()) {
+            clog << "failed to open " << opts.list << ": " << strerror(errno) << endl;
+            return false;
+        }
+        list = &listFile;
+    }
+
+    unsigned threads = opts.threads ? opts.threads : 1;
+    vector<Job> window(threads * 4);
+    bool good = true;
+    for (;;) {
+        size_t count = 0;
+        while (count < window.size() && getline(*list, window[count].name))
+            if (!window[count].name.empty())
+                ++count;
+        if (count == 0)
+            break;
+        runThreads(threads, [&] (unsigned t) -> void {
+            for (size_t i = t; i < count; i += threads)
+                runJob(window[i], opts);
+        });
+        for (size_t i = 0; i < count; ++i) {
+            Job &job = window[i];
+            if (!job.error.empty()) {
+                cerr << job.name << ": " << job.error << endl;
+                good = false;
+            } else {
+                out << job.output;
+            }
+            job.output.clear();
+            job.error.clear();
+        }
+        out.flush();
+    }
+    return good;
+}
+
+/*
+ * Replace a file with its indented form. We write a temporary file in the
+ * same directory, preallocated to roughly the size we expect so the
+ * filesystem can lay it out in one go, and rename it over the original once
+ * it's complete, so readers see either the old content or the new. The
+ * file is synced before the rename and the directory after it, so a crash
+ * can't leave the name on a file whose content never reached the disk.
+ */
+static string
+replaceFile(const char *name)
+{
+    char *real = realpath(name, 0); // replace a symlink's target, not the link.
+    if (!real)
+        return string("failed to resolve: ") + strerror(errno);
+    string target(real);
+    free(real);
+    struct stat st;
+    ifstream in(target);
+    if (!in.good() || stat(target.c_str(), &st) == -1)
+        return string("failed to open: ") + strerror(errno);
+
+    string dir = target.substr(0, target.rfind('/') + 1);
+    string temp = dir + ".jdent.XXXXXX";
+    int fd = mkstemp(&temp[0]);
+    if (fd == -1)
+        return "failed to create " + temp + ": " + strerror(errno);
+    if (st.st_size)
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, 2 * st.st_size); // just a hint.
+
+    string error;
+    {
+        // Room for the whole output of a small file, and a huge page for a big one.
+        FdOutputBuf buf(fd, min(max(size_t(2 * st.st_size), size_t(1) << 16), size_t(2) << 20));
+        ostream out(&buf);
+        error = indentFile(in, out);
+        if (error.empty() && (!out.flush() || ftruncate(fd, buf.bytesWritten()) == -1))
+            error = string("failed writing ") + temp + ": " + strerror(errno);
+    }
+    if (error.empty() && fchmod(fd, st.st_mode & 07777) == -1)
+        error = string("failed to set mode of ") + temp + ": " + strerror(errno);
+    if (error.empty() && fsync(fd) == -1)
+        error = string("failed to sync ") + temp + ": " + strerror(errno);
+    close(fd);
+    if (error.empty() && rename(temp.c_str(), target.c_str()) == -1)
+        error = "failed to replace " + target + ": " + strerror(errno);
+    if (!error.empty()) {
+        unlink(temp.c_str());
+        return error;
+    }
+    int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd == -1 || fsync(dirFd) == -1)
+        error = "failed to sync " + dir + ": " + strerror(errno);
+    if (dirFd != -1)
+        close(dirFd);
+    return error;
+}
+
+bool
+indentInPlace(const Inputs &inputs, unsigned threads)
+{
+    vector<string> errors(inputs.size());
+    atomic<size_t> next(0);
+    runThreads(max(threads, 1U), [&] (unsigned) -> void {
+        for (size_t i; (i = next++) < inputs.size();)
+            errors[i] = replaceFile(inputs[i]);
+    });
+    bool good = true;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (!errors[i].empty()) {
+            cerr << inputs[i] << ": " << errors[i] << endl;
+            good = false;
+        }
+    }
+    return good;
+}
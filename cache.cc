@@ -0,0 +1,145 @@
+// A cache of indented output, keyed by the input and how it was formatted.
+#include <jdent.h>
+#include <hash.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+OutputCache::OutputCache(const string &dir_, bool byContent_, const string &options_)
+    : dir(dir_), byContent(byContent_), options(options_ + ";version=" JDENT_VERSION)
+{
+}
+
+/*
+ * By default a file is identified by its device, inode, size and
+ * modification time, which costs a stat. With "byContent" we hash the file
+ * itself, which survives copies and touches but has to read every byte.
+ */
+bool
+OutputCache::key(const char *name, Hash128 &key) const
+{
+    struct stat st;
+    if (stat(name, &st) == -1 || !S_ISREG(st.st_mode))
+        return false;
+    Hash128 optionsHash = hash128(options);
+    if (!byContent) {
+        uint64_t identity[] = {
+            uint64_t(st.st_dev), uint64_t(st.st_ino), uint64_t(st.st_size),
+            uint64_t(st.st_mtim.tv_sec), uint64_t(st.st_mtim.tv_nsec),
+            optionsHash.hi, optionsHash.lo
+        };
+        key = hash128(identity, sizeof identity);
+        return true;
+    }
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    void *p = st.st_size ? mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : 0;
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    key = hash128(p, st.st_size, optionsHash.lo ^ optionsHash.hi);
+    if (p)
+        munmap(p, st.st_size);
+    return true;
+}
+
+int
+OutputCache::get(const char *name, string &error) const
+{
+    error.clear();
+    Hash128 k;
+    if (!key(name, k))
+        return -1;
+    string path = dir + "/" + k.hex();
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd != -1)
+        return fd;
+
+    // A miss: format into a temporary file, and publish it with a rename so
+    // concurrent users never see partial output.
+    ifstream in(name);
+    if (!in.good()) {
+        error = string("failed to open: ") + strerror(errno);
+        return -1;
+    }
+    string temp = path + ".XXXXXX";
+    int tempFd = mkstemp(&temp[0]);
+    if (tempFd == -1) {
+        error = "failed to create cache entry in " + dir + ": " + strerror(errno);
+        return -1;
+    }
+    close(tempFd);
+    ofstream out(temp, ios::trunc);
+    error = indentDocument(in, out);
+    if (!error.empty())
+        error = "invalid JSON: " + error;
+    out.close();
+    if (error.empty() && !out)
+        error = "failed writing cache entry: " + string(strerror(errno));
+    if (error.empty() && rename(temp.c_str(), path.c_str()) == -1)
+        error = "failed to add cache entry: " + string(strerror(errno));
+    if (!error.empty()) {
+        unlink(temp.c_str());
+        return -1;
+    }
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        error = "failed to open cache entry: " + string(strerror(errno));
+    return fd;
+}
+
+/*
+ * Copy the rest of one file to another without bringing it into user space:
+ * copy_file_range shares extents where the filesystem can (a reflink),
+ * sendfile handles pipes and sockets, and read/write handles the rest.
+ */
+bool
+copyFd(int from, int to)
+{
+    static const size_t chunk = 1 << 30;
+    ssize_t rc;
+    while ((rc = copy_file_range(from, 0, to, 0, chunk, 0)) > 0)
+        ;
+    if (rc == 0)
+        return true;
+    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF)
+        return false;
+    while ((rc = sendfile(to, from, 0, chunk)) > 0)
+        ;
+    if (rc == 0)
+        return true;
+    if (errno != EINVAL && errno != ENOSYS)
+        return false;
+    char buf[1 << 16];
+    while ((rc = read(from, buf, sizeof buf)) > 0) {
+        for (ssize_t off = 0; off < rc;) {
+            ssize_t written = write(to, buf + off, rc - off);
+            if (written == -1 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+            off += written;
+        }
+    }
+    return rc == 0;
+}
+
+bool
+copyFd(int from, ostream &to)
+{
+    char buf[1 << 16];
+    ssize_t rc;
+    while ((rc = read(from, buf, sizeof buf)) > 0)
+        to.write(buf, rc);
+    return rc == 0 && to.good();
+}
@@ -0,0 +1,86 @@
+#!/bin/sh
+# Regression checks for ./jdent, run by "make check".
+fail=0
+
+# expect status output args...: feed $input to "./jdent args" and compare
+# its exit status and stdout.
+expect() {
+    want_status=$1
+    want_out=$2
+    shift 2
+    got_out=$(printf '%s' "$input" | ./jdent "$@" 2> /dev/null)
+    got_status=$?
+    if [ "$got_status" != "$want_status" ] || [ "$got_out" != "$want_out" ]
+    then
+        echo "fail: jdent $* on '$input' (status $got_status)"
+        fail=1
+    fi
+}
+
+# --top reports records that are bad from their first token.
+for bad in 'xyz' ']' '"str'
+do
+    input=$(printf '{"a":1}\n%s\n{"a":2}' "$bad")
+    expect 1 '{"a":2}' --top 1 a
+done
+input=$(printf '{"a":1}\n{"a":2}')
+expect 0 '{"a":2}' --top 1 a
+
+# A quoted "*" is a key, not a wildcard.
+input='{"*":1,"b":2}'
+expect 0 '1' --csv '\*' --no-header
+
+# --csv refuses paths that overlap, but repeats a column named twice.
+input='{"a":{"d":5}}'
+expect 1 '' --csv a,a.d --no-header
+expect 0 '5,5' --csv a.d,a.d --no-header
+
+# --columnar refuses paths that overlap, or one named twice however it's spelled.
+input='{"a":1}'
+expect 1 '' --columnar /dev/null --columns 'a,\a'
+expect 1 '' --columnar /dev/null --columns 'a.d,a'
+
+# -n --batched formats each record as plain -n does, reusing one tokenizer.
+input=$(printf '{"a":1}\n[1,\n"x"')
+for j in 1 4
+do
+    expect 1 "$(printf '{\n    "a": 1\n}\n"x"')" -n --batched -j $j
+done
+
+# --max-open writes out what it holds for the partitions it closes.
+dir=$(mktemp -d)
+awk 'BEGIN { for (i = 0; i < 5000; i++) printf "{\"k\":\"%s\",\"v\":\"%0100d\"}\n", i % 5 ? "a" : "b", i }' |
+    ./jdent --partition-by k --out-dir "$dir" --max-open 1
+if [ "$(cat "$dir"/*.ndjson | wc -l)" -ne 5000 ]
+then
+    echo "fail: jdent --partition-by k --max-open 1 lost records"
+    fail=1
+fi
+rm -rf "$dir"
+
+# --partition-by gives values too long for a file name files of their own.
+dir=$(mktemp -d)
+long=$(awk 'BEGIN { for (i = 0; i < 300; i++) printf "x" }')
+printf '{"k":"%s"}\n{"k":"%sy"}\n' "$long" "$long" |
+    ./jdent --partition-by k --out-dir "$dir" ||
+    { echo "fail: jdent --partition-by on long values"; fail=1; }
+if [ "$(ls "$dir" | wc -l)" -ne 2 ]
+then
+    echo "fail: jdent --partition-by merged long values"
+    fail=1
+fi
+rm -rf "$dir"
+
+# --serve only replaces a stale socket, not a file that happens to be there.
+file=$(mktemp)
+echo keep > "$file"
+input=''
+expect 1 '' --serve "$file"
+if [ "$(cat "$file")" != keep ]
+then
+    echo "fail: jdent --serve replaced a regular file"
+    fail=1
+fi
+rm -f "$file"
+
+exit $fail
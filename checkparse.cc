@@ -0,0 +1,135 @@
+// Checks for the parsing functions in json.h, run by "make check".
+#include <json.h>
+#include <events.h>
+#include <jdent.h>
+#include <iostream>
+#include <stdexcept>
+#include <limits>
+#include <string>
+
+using namespace JSON;
+using namespace std;
+
+static bool good = true;
+
+// Parse "text" as an I, expecting "want", or failure if "ok" is false.
+template <typename I> static void
+expectInt(const string &text, bool ok, I want = 0)
+{
+    MemoryStream in(text.data(), text.size());
+    ParseError err;
+    I value = 0;
+    bool parsed = parseInt(in, value, err);
+    const char *type = numeric_limits<I>::is_signed ? "-bit signed" : "-bit unsigned";
+    if (parsed != ok || (ok && value != want)) {
+        cerr << "parseInt<" << sizeof (I) * 8 << type
+             << ">(" << text << "): " << (parsed ? "got " + to_string(value) : err.message()) << endl;
+        good = false;
+    }
+    // parseNumber, which throws, should agree.
+    MemoryStream again(text.data(), text.size());
+    try {
+        value = parseNumber<I>(again);
+        parsed = true;
+    }
+    catch (const InvalidJSON &) {
+        parsed = false;
+    }
+    if (parsed != ok || (ok && value != want)) {
+        cerr << "parseNumber<" << sizeof (I) * 8 << type << ">(" << text << "): "
+             << (parsed ? "got " + to_string(value) : "failed") << endl;
+        good = false;
+    }
+}
+
+// The ends of I's range parse, and one past each doesn't.
+template <typename I> static void
+boundaries()
+{
+    I lo = numeric_limits<I>::min(), hi = numeric_limits<I>::max();
+    expectInt<I>(to_string(lo), true, lo);
+    expectInt<I>(to_string(hi), true, hi);
+    expectInt<I>("0", true, 0);
+    expectInt<I>("-0", true, 0);
+    if (numeric_limits<I>::is_signed) {
+        expectInt<I>("-" + to_string(uint64_t(0) - uint64_t(lo) + 1), false);
+        expectInt<I>(to_string(uint64_t(hi) + 1), false);
+    } else {
+        expectInt<I>("-1", false);
+        if (hi != numeric_limits<uint64_t>::max())
+            expectInt<I>(to_string(uint64_t(hi) + 1), false);
+    }
+}
+
+// A stream that gives some input, then fails as a bad disk or socket would.
+class FailingBuf : public streambuf {
+    string text;
+    bool given = false;
+protected:
+    int_type underflow() override {
+        if (given)
+            throw runtime_error("read failed");
+        given = true;
+        setg(&text[0], &text[0], &text[0] + text.size());
+        return traits_type::to_int_type(text[0]);
+    }
+public:
+    FailingBuf(const string &text_) : text(text_) {}
+};
+
+// Notes where each string starts.
+struct StringOffsets : EventHandler {
+    vector<size_t> offsets;
+    bool events(const EventBatch &batch, ParseError &) override {
+        for (const Token &token : batch.tokens)
+            if (token.type == EventType::String)
+                offsets.push_back(batch.event(token).offset);
+        return true;
+    }
+};
+
+// parseEvents over "in" fails with "code" at "offset".
+static void
+expectEventsFail(istream &in, const char *what, Errc code, streamoff offset)
+{
+    StringOffsets handler;
+    ParseError err;
+    if (parseEvents(in, handler, err) || err.code != code || err.offset != offset) {
+        cerr << "parseEvents(" << what << "): " << (err ? err.message() : "succeeded") << endl;
+        good = false;
+    }
+}
+
+int
+main()
+{
+    boundaries<int8_t>();
+    boundaries<uint8_t>();
+    boundaries<int16_t>();
+    boundaries<uint16_t>();
+    boundaries<int32_t>();
+    boundaries<uint32_t>();
+    boundaries<int64_t>();
+    boundaries<uint64_t>();
+    expectInt<uint64_t>("18446744073709551616", false);
+    expectInt<uint64_t>("99999999999999999999", false);
+    expectInt<uint64_t>("100000000000000000000", false);
+    expectInt<int64_t>("-9223372036854775809", false);
+    expectInt<int64_t>("1.5", false);
+    expectInt<unsigned long>("18446744073709551615", true, 18446744073709551615UL);
+
+    // A stream that goes bad ends the events with an error, not a spin.
+    FailingBuf failing("[1, 2");
+    istream failingIn(&failing);
+    expectEventsFail(failingIn, "a stream that goes bad", Errc::ReadFailed, 0);
+    // Strings with escapes are placed where they are, like those without.
+    string strings = "[\"ok\", \"\\u00e9\", \"x\"]";
+    MemoryStream stringsIn(strings.data(), strings.size());
+    StringOffsets handler;
+    ParseError err;
+    if (!parseEvents(stringsIn, handler, err) || handler.offsets != vector<size_t>{ 1, 7, 17 }) {
+        cerr << "parseEvents(" << strings << "): wrong string offsets" << endl;
+        good = false;
+    }
+    return good ? 0 : 1;
+}
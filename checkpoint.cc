@@ -0,0 +1,101 @@
+// Saving and loading checkpoints of long-running jobs.
+#include <jdent.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+using namespace JSON;
+using namespace std;
+
+/*
+ * A checkpoint is a JSON object, written to a temporary file and renamed
+ * into place, so there's always a complete one to resume from.
+ */
+bool
+Checkpoint::save(const string &path, string &error) const
+{
+    ostringstream os;
+    os << "{\n  \"version\": 1,\n  \"input\": \"" << Escape(input)
+       << "\",\n  \"options\": \"" << Escape(options)
+       << "\",\n  \"inputOffset\": " << inputOffset
+       << ",\n  \"outputOffset\": " << outputOffset
+       << ",\n  \"stack\": [";
+    for (size_t i = 0; i < stack.size(); ++i)
+        os << (i ? "," : "") << "\n    { \"object\": " << (stack[i].object ? "true" : "false")
+           << ", \"count\": " << stack[i].count
+           << ", \"key\": \"" << Escape(stack[i].key) << "\" }";
+    os << "\n  ]\n}\n";
+
+    string temp = path + ".XXXXXX";
+    int fd = mkstemp(&temp[0]);
+    if (fd == -1) {
+        error = "failed to create " + temp + ": " + strerror(errno);
+        return false;
+    }
+    string text = os.str();
+    bool ok = write(fd, text.data(), text.size()) == ssize_t(text.size()) && fdatasync(fd) == 0;
+    if (close(fd) == -1)
+        ok = false;
+    if (ok && rename(temp.c_str(), path.c_str()) == -1)
+        ok = false;
+    if (!ok) {
+        error = "failed to write " + path + ": " + strerror(errno);
+        unlink(temp.c_str());
+    }
+    return ok;
+}
+
+bool
+Checkpoint::load(const string &path, string &error)
+{
+    ifstream in(path);
+    if (!in.good()) {
+        error = "failed to open " + path + ": " + strerror(errno);
+        return false;
+    }
+    try {
+        long version = 0;
+        stack.clear();
+        parseObject(in, [&] (istream &in, const string &field) -> void {
+            if (field == "version")
+                version = parseInt<long>(in);
+            else if (field == "input")
+                input = parseString(in);
+            else if (field == "options")
+                options = parseString(in);
+            else if (field == "inputOffset")
+                inputOffset = parseInt<unsigned long>(in);
+            else if (field == "outputOffset")
+                outputOffset = parseInt<unsigned long>(in);
+            else if (field == "stack")
+                parseArray(in, [&] (istream &in) -> void {
+                    Level level { false, 0, "" };
+                    parseObject(in, [&] (istream &in, const string &field) -> void {
+                        if (field == "object")
+                            level.object = parseBoolean(in);
+                        else if (field == "count")
+                            level.count = parseInt<unsigned long>(in);
+                        else if (field == "key")
+                            level.key = parseString(in);
+                        else
+                            parseValue(in);
+                    });
+                    stack.push_back(level);
+                });
+            else
+                parseValue(in);
+        });
+        if (version != 1) {
+            error = path + ": not a checkpoint we understand";
+            return false;
+        }
+    }
+    catch (const InvalidJSON &je) {
+        error = path + ": invalid checkpoint: " + je.what();
+        return false;
+    }
+    return true;
+}
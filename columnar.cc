@@ -0,0 +1,454 @@
+// Shred NDJSON records into a columnar file.
+#include <jdent.h>
+#include <path.h>
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_map>
+
+using namespace JSON;
+using namespace std;
+
+/*
+ * File layout. All integers are little-endian.
+ *
+ *   magic           "JDCOL1\0\0"
+ *   row groups      column chunks, back to back
+ *   footer          u32 column count
+ *                   per column: u16 name length, name (a path), u8 schema type
+ *                   u32 row group count
+ *                   per row group: u64 rows, then per column:
+ *                       u8 chunk type, u64 file offset, u64 length
+ *   trailer         u64 footer offset, magic
+ *
+ * Each chunk starts with a null bitmap of (rows + 7) / 8 bytes, bit set
+ * where the row has a value. What follows depends on the chunk type:
+ *
+ *   Int64, Double   rows * 8 bytes, zero for nulls
+ *   Bool            a bitmap like the null bitmap
+ *   String          u32 dictionary size n, u32 offsets[n + 1], string bytes,
+ *                   then u32 codes[rows] indexing the dictionary
+ *   Json            u32 offsets[rows + 1], then compact JSON text per row
+ *
+ * The schema type of a column is inferred from a sample of records. A chunk
+ * normally has its column's type, but if a row group holds values that don't
+ * fit, the chunk is widened (Int64 to Double, otherwise to Json) rather than
+ * losing them, so readers must check the chunk type.
+ */
+
+namespace {
+
+enum ColumnType : uint8_t { Int64Col = 1, DoubleCol, BoolCol, StringCol, JsonCol };
+
+struct Cell {
+    uint8_t type; // 0 for null or missing.
+    int64_t i;
+    double d;
+    string s;
+};
+
+static void
+readCell(istream &l, Cell &cell)
+{
+    switch (peekType(l)) {
+        case Number: {
+            string text = parseNumberText(l);
+            if (integerValue(text.data(), text.size(), cell.i)) {
+                cell.type = Int64Col;
+                break;
+            }
+            cell.type = DoubleCol;
+            cell.d = strtod(text.c_str(), 0);
+            break;
+        }
+        case String: cell.type = StringCol; cell.s = parseString(l); break;
+        case Boolean: cell.type = BoolCol; cell.i = parseBoolean(l); break;
+        case Null: parseNull(l); cell.type = 0; break;
+        default: {
+            ostringstream os;
+            canonicalValue(l, os);
+            cell.type = JsonCol;
+            cell.s = os.str();
+            break;
+        }
+    }
+}
+
+// The narrowest type that can hold both a and b.
+static uint8_t
+widen(uint8_t a, uint8_t b)
+{
+    if (a == 0 || a == b)
+        return b;
+    if (b == 0)
+        return a;
+    if ((a == Int64Col && b == DoubleCol) || (a == DoubleCol && b == Int64Col))
+        return DoubleCol;
+    return JsonCol;
+}
+
+static string
+cellJson(const Cell &cell)
+{
+    switch (cell.type) {
+        case Int64Col: return to_string(cell.i);
+        case DoubleCol: {
+            char buf[32];
+            snprintf(buf, sizeof buf, "%.17g", cell.d);
+            return buf;
+        }
+        case BoolCol: return cell.i ? "true" : "false";
+        case StringCol: {
+            ostringstream os;
+            os << "\"" << Escape(cell.s) << "\"";
+            return os.str();
+        }
+        default: return cell.s;
+    }
+}
+
+// Append "value" little-endian, whatever the host's byte order.
+template <typename T> static void
+put(string &buf, T value)
+{
+    if constexpr (endian::native == endian::little) {
+        buf.append(reinterpret_cast<const char *>(&value), sizeof value);
+    } else {
+        char bytes[sizeof value];
+        memcpy(bytes, &value, sizeof value);
+        reverse(bytes, bytes + sizeof value);
+        buf.append(bytes, sizeof value);
+    }
+}
+
+static void
+putBitmap(string &buf, const vector<Cell> &cells, bool (*bit)(const Cell &))
+{
+    string bitmap((cells.size() + 7) / 8, '\0');
+    for (size_t row = 0; row < cells.size(); ++row)
+        if (bit(cells[row]))
+            bitmap[row / 8] |= char(1 << row % 8);
+    buf += bitmap;
+}
+
+static void
+encodeChunk(string &buf, uint8_t type, const vector<Cell> &cells)
+{
+    putBitmap(buf, cells, [] (const Cell &c) { return c.type != 0; });
+    switch (type) {
+        case Int64Col:
+            for (auto &c : cells)
+                put<int64_t>(buf, c.type ? c.i : 0);
+            break;
+        case DoubleCol:
+            for (auto &c : cells)
+                put<double>(buf, c.type == DoubleCol ? c.d : c.type == Int64Col ? double(c.i) : 0);
+            break;
+        case BoolCol:
+            putBitmap(buf, cells, [] (const Cell &c) { return c.type != 0 && c.i != 0; });
+            break;
+        case StringCol: {
+            unordered_map<string, uint32_t> codes;
+            vector<const string *> dictionary;
+            vector<uint32_t> rowCodes;
+            for (auto &c : cells) {
+                if (c.type == 0) {
+                    rowCodes.push_back(0);
+                    continue;
+                }
+                auto ins = codes.insert(make_pair(c.s, uint32_t(dictionary.size())));
+                if (ins.second)
+                    dictionary.push_back(&ins.first->first);
+                rowCodes.push_back(ins.first->second);
+            }
+            put<uint32_t>(buf, dictionary.size());
+            uint32_t offset = 0;
+            put<uint32_t>(buf, offset);
+            for (auto s : dictionary)
+                put<uint32_t>(buf, offset += s->size());
+            for (auto s : dictionary)
+                buf += *s;
+            for (auto code : rowCodes)
+                put<uint32_t>(buf, code);
+            break;
+        }
+        default: {
+            vector<string> texts;
+            for (auto &c : cells)
+                texts.push_back(c.type ? cellJson(c) : string());
+            uint32_t offset = 0;
+            put<uint32_t>(buf, offset);
+            for (auto &text : texts)
+                put<uint32_t>(buf, offset += text.size());
+            for (auto &text : texts)
+                buf += text;
+            break;
+        }
+    }
+}
+
+struct Schema {
+    vector<string> names;
+    vector<uint8_t> types;
+    PathTrie trie;
+    vector<int> ids; // trie index for each column.
+
+    void add(const string &name, uint8_t type) {
+        names.push_back(name);
+        types.push_back(type);
+        ids.push_back(trie.add(name));
+    }
+};
+
+// Quote a key so splitPath gives it back intact.
+static string
+pathKey(const string &key)
+{
+    string rv;
+    for (char c : key) {
+        if (c == '.' || c == '\\' || c == '*')
+            rv += '\\';
+        rv += c;
+    }
+    return rv;
+}
+
+// Refuse "columns" if two overlap, as only one would get its values.
+static bool
+distinctColumns(const vector<string> &columns)
+{
+    vector<vector<PathKey>> keys;
+    for (auto &column : columns)
+        keys.push_back(splitPath(column));
+    for (size_t i = 0; i < keys.size(); ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            if (pathsOverlap(keys[i], keys[j])) {
+                clog << "--columns paths " << columns[j] << " and " << columns[i] << " overlap" << endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Find the leaves of a sample record: members of nested objects become
+ * columns of their own, while arrays and scalars are a single column.
+ */
+static void
+sampleLeaves(istream &l, const string &path, vector<string> &order,
+        unordered_map<string, uint8_t> &types)
+{
+    if (peekType(l) == Object) {
+        parseObject(l, [&] (istream &l, string key) -> void {
+            sampleLeaves(l, path.empty() ? pathKey(key) : path + "." + pathKey(key), order, types);
+        });
+        return;
+    }
+    Cell cell;
+    readCell(l, cell);
+    auto it = types.find(path);
+    if (it == types.end()) {
+        order.push_back(path);
+        types[path] = cell.type;
+    } else {
+        it->second = widen(it->second, cell.type);
+    }
+}
+
+static void
+inferSchema(Schema &schema, const vector<string> &records, size_t count,
+        const vector<string> &columns)
+{
+    vector<string> order;
+    unordered_map<string, uint8_t> types;
+    for (size_t i = 0; i < count; ++i) {
+        MemoryStream in(records[i].data(), records[i].size());
+        try {
+            sampleLeaves(in, "", order, types);
+        }
+        catch (const InvalidJSON &) {
+            // reported when the record is shredded.
+        }
+    }
+    if (!columns.empty()) {
+        order = columns;
+    } else {
+        // A field that's an object in some records but not in others can't
+        // be split into its members, as walkPaths stops at it: keep it whole.
+        vector<vector<PathKey>> keys;
+        for (auto &name : order)
+            keys.push_back(splitPath(name));
+        vector<bool> inside(order.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            for (size_t j = 0; j < order.size(); ++j) {
+                if (keys[i].size() < keys[j].size() && pathsOverlap(keys[i], keys[j])) {
+                    types[order[i]] = JsonCol;
+                    inside[j] = true;
+                }
+            }
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < order.size(); ++i)
+            if (!inside[i])
+                order[kept++] = order[i];
+        order.resize(kept);
+    }
+    for (auto &name : order) {
+        uint8_t type = types[name];
+        schema.add(name, type ? type : JsonCol);
+    }
+}
+
+struct RowGroup {
+    uint64_t rows;
+    string data;
+    vector<uint8_t> types;
+    vector<uint64_t> offsets; // of each chunk within "data".
+    vector<pair<size_t, string>> errors; // record index in batch, message.
+};
+
+static void
+shred(const Schema &schema, const vector<string> &records, size_t begin, size_t end, RowGroup &group)
+{
+    size_t ncols = schema.names.size();
+    vector<vector<Cell>> cells(ncols);
+    vector<Cell *> row(schema.trie.size());
+    group.data.clear();
+    group.errors.clear();
+    group.types.assign(ncols, 0);
+    group.offsets.clear();
+    group.rows = 0;
+    for (size_t i = begin; i < end; ++i) {
+        for (size_t col = 0; col < ncols; ++col) {
+            cells[col].emplace_back();
+            cells[col].back().type = 0;
+            row[schema.ids[col]] = &cells[col].back();
+        }
+        MemoryStream in(records[i].data(), records[i].size());
+        try {
+            walkPaths(in, schema.trie.root, [&row] (istream &l, int id) -> void {
+                readCell(l, *row[id]);
+            });
+        }
+        catch (const InvalidJSON &je) {
+            group.errors.emplace_back(i, je.what());
+            for (auto &column : cells)
+                column.pop_back();
+            continue;
+        }
+        group.rows++;
+    }
+    for (size_t col = 0; col < ncols; ++col) {
+        uint8_t type = 0;
+        for (auto &c : cells[col])
+            type = widen(type, c.type);
+        type = widen(schema.types[col], type);
+        group.types[col] = type;
+        group.offsets.push_back(group.data.size());
+        encodeChunk(group.data, type, cells[col]);
+    }
+    group.offsets.push_back(group.data.size());
+}
+
+}
+
+bool
+columnarRecords(const Inputs &inputs, const ColumnarOptions &opts)
+{
+    static const char magic[8] = { 'J', 'D', 'C', 'O', 'L', '1', 0, 0 };
+    if (!distinctColumns(opts.columns))
+        return false;
+    ofstream out(opts.file, ios::binary | ios::trunc);
+    if (!out.good()) {
+        clog << "failed to open " << opts.file << ": " << strerror(errno) << endl;
+        return false;
+    }
+    out.write(magic, sizeof magic);
+
+    unsigned threads = opts.threads ? opts.threads : 1;
+    size_t groupRows = opts.rowGroupSize ? opts.rowGroupSize : 1;
+    vector<string> records(threads * groupRows);
+    vector<RowGroup> groups(threads);
+    size_t count = 0;
+    Schema schema;
+    bool haveSchema = false;
+    string footerGroups;
+    uint32_t groupCount = 0;
+    uint64_t offset = sizeof magic;
+    const char *currentName = "";
+    unsigned long recordNo = 0;
+    bool good = true;
+
+    // Shred up to one row group per thread, then write them in order.
+    auto drain = [&] () -> void {
+        if (!haveSchema) {
+            inferSchema(schema, records, min(count, opts.sampleSize), opts.columns);
+            haveSchema = true;
+        }
+        size_t ngroups = (count + groupRows - 1) / groupRows;
+        runThreads(threads, [&] (unsigned t) -> void {
+            if (t < ngroups)
+                shred(schema, records, t * groupRows, min(count, (t + 1) * groupRows), groups[t]);
+        });
+        for (size_t t = 0; t < ngroups; ++t) {
+            RowGroup &group = groups[t];
+            for (auto &error : group.errors) {
+                cerr << currentName << ":" << recordNo - count + error.first + 1
+                     << ": invalid JSON: " << error.second << endl;
+                good = false;
+            }
+            put<uint64_t>(footerGroups, group.rows);
+            for (size_t col = 0; col < group.types.size(); ++col) {
+                put<uint8_t>(footerGroups, group.types[col]);
+                put<uint64_t>(footerGroups, offset + group.offsets[col]);
+                put<uint64_t>(footerGroups, group.offsets[col + 1] - group.offsets[col]);
+            }
+            out.write(group.data.data(), group.data.size());
+            offset += group.data.size();
+            groupCount++;
+        }
+        count = 0;
+    };
+
+    good = forEachInput(inputs, [&] (istream &in, const char *name) -> void {
+        currentName = name;
+        recordNo = 0;
+        forEachRecord(in, [&] (string &line) -> void {
+            ++recordNo;
+            records[count++].swap(line);
+            if (count == records.size())
+                drain();
+        });
+        if (count)
+            drain();
+    }) && good;
+    if (!haveSchema)
+        inferSchema(schema, records, 0, opts.columns);
+
+    string footer;
+    put<uint32_t>(footer, schema.names.size());
+    for (size_t col = 0; col < schema.names.size(); ++col) {
+        put<uint16_t>(footer, schema.names[col].size());
+        footer += schema.names[col];
+        put<uint8_t>(footer, schema.types[col]);
+    }
+    put<uint32_t>(footer, groupCount);
+    footer += footerGroups;
+    put<uint64_t>(footer, offset);
+    footer.append(magic, sizeof magic);
+    out.write(footer.data(), footer.size());
+    out.close();
+    if (!out) {
+        clog << "failed writing " << opts.file << ": " << strerror(errno) << endl;
+        good = false;
+    }
+    return good;
+}
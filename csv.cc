@@ -0,0 +1,174 @@
+// Export fields of NDJSON records as CSV or TSV.
+#include <jdent.h>
+#include <path.h>
+#include <iostream>
+#include <sstream>
+
+using namespace JSON;
+using namespace std;
+
+namespace {
+
+// Text for a cell: strings unquoted, null as empty, containers as compact JSON.
+static void
+cellText(istream &l, string &cell)
+{
+    switch (peekType(l)) {
+        case String: cell = parseString(l); break;
+        case Number: cell = parseNumberText(l); break;
+        case Boolean: cell = parseBoolean(l) ? "true" : "false"; break;
+        case Null: parseNull(l); cell.clear(); break;
+        default: {
+            ostringstream os;
+            canonicalValue(l, os);
+            cell = os.str();
+            break;
+        }
+    }
+}
+
+/*
+ * CSV quoting is per RFC 4180: fields with separators, quotes or line breaks
+ * are quoted, with quotes doubled. TSV can't quote, so tabs, line breaks and
+ * backslashes are written as backslash escapes instead.
+ */
+static void
+appendCell(string &out, const string &cell, char sep)
+{
+    if (sep == '\t') {
+        for (char c : cell) {
+            switch (c) {
+                case '\t': out += "\\t"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\\': out += "\\\\"; break;
+                default: out += c; break;
+            }
+        }
+    } else if (cell.find_first_of(string(1, sep) + "\"\r\n") != string::npos) {
+        out += '"';
+        for (char c : cell) {
+            if (c == '"')
+                out += '"';
+            out += c;
+        }
+        out += '"';
+    } else {
+        out += cell;
+    }
+}
+
+/*
+ * Refuse "columns" if two different paths overlap, as walkPaths would only
+ * fill in one of them. The same path twice is fine: both get its value.
+ */
+static bool
+distinctColumns(const vector<string> &columns)
+{
+    vector<vector<PathKey>> keys;
+    for (auto &column : columns)
+        keys.push_back(splitPath(column));
+    for (size_t i = 0; i < keys.size(); ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            if (columns[i] != columns[j] && pathsOverlap(keys[i], keys[j])) {
+                clog << "columns " << columns[j] << " and " << columns[i] << " overlap" << endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+class Projector {
+    PathTrie trie;
+    vector<int> columns; // trie index for each output column.
+    char sep;
+public:
+    Projector(const vector<string> &paths, char sep_) : sep(sep_) {
+        for (auto &path : paths)
+            columns.push_back(trie.add(path));
+    }
+
+    // Append the CSV line for a record to "out"; on failure, return the error.
+    string project(const string &record, string &out) const {
+        vector<string> cells(trie.size());
+        MemoryStream in(record.data(), record.size());
+        try {
+            walkPaths(in, trie.root, [&cells] (istream &l, int id) -> void {
+                cellText(l, cells[id]);
+            });
+        }
+        catch (const InvalidJSON &je) {
+            return je.what();
+        }
+        for (size_t i = 0; i < columns.size(); ++i) {
+            if (i)
+                out += sep;
+            appendCell(out, cells[columns[i]], sep);
+        }
+        out += '\n';
+        return string();
+    }
+};
+
+}
+
+bool
+csvRecords(const Inputs &inputs, ostream &out, const CsvOptions &opts)
+{
+    static const size_t batchSize = 1 << 14;
+    if (!distinctColumns(opts.columns))
+        return false;
+    Projector projector(opts.columns, opts.sep);
+    unsigned threads = opts.threads ? opts.threads : 1;
+    vector<string> records(batchSize);
+    vector<string> errors(batchSize);
+    vector<string> chunks(threads);
+    size_t count = 0;
+    unsigned long recordNo = 0;
+    const char *currentName = "";
+    bool good = true;
+
+    if (opts.header) {
+        string line;
+        for (size_t i = 0; i < opts.columns.size(); ++i) {
+            if (i)
+                line += opts.sep;
+            appendCell(line, opts.columns[i], opts.sep);
+        }
+        out << line << "\n";
+    }
+
+    // Each thread formats a contiguous slice of the batch; slices are written in order.
+    auto drain = [&] () -> void {
+        runThreads(threads, [&] (unsigned t) -> void {
+            chunks[t].clear();
+            for (size_t i = count * t / threads; i < count * (t + 1) / threads; ++i)
+                errors[i] = projector.project(records[i], chunks[t]);
+        });
+        for (size_t i = 0; i < count; ++i) {
+            if (!errors[i].empty()) {
+                cerr << currentName << ":" << recordNo - count + i + 1
+                     << ": invalid JSON: " << errors[i] << endl;
+                good = false;
+            }
+        }
+        for (auto &chunk : chunks)
+            out.write(chunk.data(), chunk.size());
+        count = 0;
+    };
+
+    good = forEachInput(inputs, [&] (istream &in, const char *name) -> void {
+        currentName = name;
+        recordNo = 0;
+        forEachRecord(in, [&] (string &line) -> void {
+            ++recordNo;
+            records[count++].swap(line);
+            if (count == batchSize)
+                drain();
+        });
+        drain();
+    }) && good;
+    out.flush();
+    return good;
+}
@@ -0,0 +1,368 @@
+// Drop repeated records from an NDJSON stream.
+#include <jdent.h>
+#include <hash.h>
+#include <path.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <system_error>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace JSON;
+using namespace std;
+
+static void
+canonicalNumber(istream &l, ostream &o)
+{
+    string text = parseNumberText(l);
+    if (text.find_first_of(".eE") == string::npos) {
+        o << (text == "-0" ? "0" : text);
+    } else {
+        MemoryStream number(text.data(), text.size());
+        char buf[32];
+        snprintf(buf, sizeof buf, "%.17g", parseFloat<double>(number));
+        o << buf;
+    }
+}
+
+/*
+ * Write a value with insignificant whitespace removed, object members sorted
+ * by key, and strings and numbers in a single spelling, so equivalent records
+ * produce identical text.
+ */
+void
+canonicalValue(istream &l, ostream &o)
+{
+    switch (peekType(l)) {
+        case Object: {
+            vector<pair<string, string>> members;
+            parseObject(l, [&members] (istream &l, string key) -> void {
+                ostringstream value;
+                canonicalValue(l, value);
+                members.emplace_back(move(key), value.str());
+            });
+            sort(members.begin(), members.end());
+            o << "{";
+            const char *sep = "";
+            for (auto &member : members) {
+                o << sep << "\"" << Escape(member.first) << "\":" << member.second;
+                sep = ",";
+            }
+            o << "}";
+            break;
+        }
+        case Array: {
+            const char *sep = "";
+            o << "[";
+            parseArray(l, [&o, &sep] (istream &l) -> void {
+                o << sep;
+                canonicalValue(l, o);
+                sep = ",";
+            });
+            o << "]";
+            break;
+        }
+        case String: o << "\"" << Escape(parseString(l)) << "\""; break;
+        case Number: canonicalNumber(l, o); break;
+        case Boolean: o << (parseBoolean(l) ? "true" : "false"); break;
+        case Null: parseNull(l); o << "null"; break;
+        default: throw InvalidJSON("unexpected end of input");
+    }
+}
+
+namespace {
+
+/*
+ * A sorted run of hashes spilled to disk. The file is unlinked as soon as
+ * it's created, so it disappears with us, and we search it through a
+ * read-only mapping.
+ */
+class SpillRun {
+    static const size_t blockSize = 4096; // hashes read or written at once when merging.
+    int fd;
+    const Hash128 *hashes;
+    size_t count;
+    void create(const string &dir);
+    void append(const Hash128 *begin, size_t n);
+    void map();
+    [[noreturn]] void fail(const char *what);
+public:
+    SpillRun(const string &dir, const Hash128 *begin, const Hash128 *end);
+    SpillRun(const string &dir, const vector<unique_ptr<SpillRun>> &runs);
+    SpillRun(const SpillRun &) = delete;
+    ~SpillRun();
+    bool contains(const Hash128 &h) const { return binary_search(hashes, hashes + count, h); }
+};
+
+SpillRun::SpillRun(const string &dir, const Hash128 *begin, const Hash128 *end)
+    : hashes(0), count(0)
+{
+    create(dir);
+    append(begin, end - begin);
+    map();
+}
+
+/*
+ * Merge sorted runs into one, reading each a block at a time rather than
+ * holding them in memory.
+ */
+SpillRun::SpillRun(const string &dir, const vector<unique_ptr<SpillRun>> &runs)
+    : hashes(0), count(0)
+{
+    struct Cursor {
+        const SpillRun *run;
+        size_t done; // hashes read from the run so far.
+        vector<Hash128> block;
+        size_t pos;
+    };
+    create(dir);
+    vector<Cursor> cursors;
+    for (auto &run : runs)
+        cursors.push_back(Cursor{ run.get(), 0, vector<Hash128>(), 0 });
+    auto refill = [this] (Cursor &c) -> void {
+        c.block.resize(min(blockSize, c.run->count - c.done));
+        c.pos = 0;
+        char *p = reinterpret_cast<char *>(c.block.data());
+        size_t left = c.block.size() * sizeof (Hash128);
+        for (off_t at = c.done * sizeof (Hash128); left != 0;) {
+            ssize_t rc = pread(c.run->fd, p, left, at);
+            if (rc == -1 && errno == EINTR)
+                continue;
+            if (rc <= 0)
+                fail("reading spill file");
+            p += rc;
+            at += rc;
+            left -= rc;
+        }
+        c.done += c.block.size();
+    };
+    for (auto &c : cursors)
+        refill(c);
+    vector<Hash128> out;
+    out.reserve(blockSize);
+    for (;;) {
+        // There are only a few runs, so look at each for the least.
+        Cursor *least = nullptr;
+        for (auto &c : cursors)
+            if (c.pos < c.block.size() && (!least || c.block[c.pos] < least->block[least->pos]))
+                least = &c;
+        if (!least)
+            break;
+        out.push_back(least->block[least->pos++]);
+        if (least->pos == least->block.size())
+            refill(*least);
+        if (out.size() == blockSize) {
+            append(out.data(), out.size());
+            out.clear();
+        }
+    }
+    append(out.data(), out.size());
+    map();
+}
+
+void
+SpillRun::create(const string &dir)
+{
+    string name = dir + "/jdent-dedup.XXXXXX";
+    fd = mkstemp(&name[0]);
+    if (fd == -1)
+        throw system_error(errno, generic_category(), "creating spill file in " + dir);
+    unlink(name.c_str());
+}
+
+// Give up on the run we're making; the destructor won't be run to close it.
+void
+SpillRun::fail(const char *what)
+{
+    int err = errno;
+    close(fd);
+    throw system_error(err, generic_category(), what);
+}
+
+void
+SpillRun::append(const Hash128 *begin, size_t n)
+{
+    const char *p = reinterpret_cast<const char *>(begin);
+    for (size_t left = n * sizeof *begin; left != 0;) {
+        ssize_t rc = write(fd, p, left);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            fail("writing spill file");
+        }
+        p += rc;
+        left -= rc;
+    }
+    count += n;
+}
+
+void
+SpillRun::map()
+{
+    if (count != 0) {
+        void *p = mmap(0, count * sizeof *hashes, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+            fail("mapping spill file");
+        hashes = static_cast<const Hash128 *>(p);
+    }
+}
+
+SpillRun::~SpillRun()
+{
+    if (hashes)
+        munmap(const_cast<Hash128 *>(hashes), count * sizeof *hashes);
+    close(fd);
+}
+
+/*
+ * The set of record hashes we've seen. Recent hashes live in an open
+ * addressing table; if that would outgrow "memLimit", its content is sorted
+ * and spilled to disk, and we consult the spilled runs on a miss. Runs are
+ * merged once there are enough of them to make misses expensive.
+ */
+class HashSet {
+    static const size_t initialSize = 1 << 16;
+    static const size_t maxRuns = 8;
+    vector<Hash128, BufferAllocator<Hash128>> table;
+    size_t used;
+    size_t memLimit;
+    string spillDir;
+    vector<unique_ptr<SpillRun>> runs;
+
+    static bool empty(const Hash128 &h) { return h.hi == 0 && h.lo == 0; }
+    Hash128 *slot(const Hash128 &h) {
+        size_t mask = table.size() - 1;
+        for (size_t i = h.lo & mask;; i = (i + 1) & mask)
+            if (empty(table[i]) || table[i] == h)
+                return &table[i];
+    }
+    void grow();
+    void spill();
+    void merge();
+public:
+    HashSet(size_t memLimit_, const string &spillDir_)
+        : table(initialSize), used(0), memLimit(memLimit_), spillDir(spillDir_) {}
+    bool insert(Hash128 h); // true if we hadn't seen "h" before.
+};
+
+bool
+HashSet::insert(Hash128 h)
+{
+    if (empty(h))
+        h.lo = 1; // reserve all-zeroes for empty slots.
+    Hash128 *s = slot(h);
+    if (!empty(*s))
+        return false;
+    for (auto &run : runs)
+        if (run->contains(h))
+            return false;
+    *s = h;
+    if (++used * 2 > table.size()) {
+        if (memLimit != 0 && table.size() * 2 * sizeof h > memLimit)
+            spill();
+        else
+            grow();
+    }
+    return true;
+}
+
+void
+HashSet::grow()
+{
+    vector<Hash128, BufferAllocator<Hash128>> old(table.size() * 2);
+    old.swap(table);
+    for (auto &h : old)
+        if (!empty(h))
+            *slot(h) = h;
+}
+
+void
+HashSet::spill()
+{
+    auto live = remove_if(table.begin(), table.end(), empty);
+    sort(table.begin(), live);
+    runs.emplace_back(new SpillRun(spillDir, &table[0], &table[0] + (live - table.begin())));
+    fill(table.begin(), table.end(), Hash128{ 0, 0 });
+    used = 0;
+    if (runs.size() >= maxRuns)
+        merge();
+}
+
+void
+HashSet::merge()
+{
+    // Runs are disjoint, as we only insert hashes we can't find in any of them.
+    unique_ptr<SpillRun> merged(new SpillRun(spillDir, runs));
+    runs.clear();
+    runs.push_back(move(merged));
+}
+
+}
+
+bool
+dedupRecords(const Inputs &inputs, ostream &out, const DedupOptions &opts)
+{
+    string spillDir = opts.spillDir;
+    if (spillDir.empty()) {
+        const char *tmp = getenv("TMPDIR");
+        spillDir = tmp ? tmp : "/tmp";
+    }
+    HashSet seen(opts.memLimit, spillDir);
+    PathTrie trie;
+    if (opts.key)
+        trie.add(opts.key);
+    MemoryStream record;
+    ostringstream canon;
+    bool good = true;
+
+    try {
+        good = forEachInput(inputs, [&] (istream &in, const char *name) -> void {
+            unsigned long lineno = 0;
+            forEachRecord(in, [&] (string &line) -> void {
+                ++lineno;
+                Hash128 h;
+                if (!opts.key && !opts.canonical) {
+                    h = hash128(line);
+                } else {
+                    canon.str("");
+                    record.reset(line);
+                    bool found = false;
+                    try {
+                        if (opts.key) {
+                            walkPaths(record, trie.root, [&] (istream &l, int) -> void {
+                                canonicalValue(l, canon);
+                                found = true;
+                            });
+                        } else {
+                            canonicalValue(record, canon);
+                            found = true;
+                        }
+                    }
+                    catch (const InvalidJSON &je) {
+                        cerr << name << ":" << lineno << ": invalid JSON: " << je.what() << endl;
+                        good = false;
+                        return;
+                    }
+                    if (!found) {
+                        // Records without the key are never duplicates.
+                        out << line << "\n";
+                        return;
+                    }
+                    h = hash128(canon.str());
+                }
+                if (seen.insert(h))
+                    out << line << "\n";
+            });
+        }) && good;
+    }
+    catch (const system_error &ex) {
+        cerr << "dedup: " << ex.what() << endl;
+        good = false;
+    }
+    out.flush();
+    return good;
+}
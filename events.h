@@ -0,0 +1,213 @@
+// Events in batches: a compact array of them for each block of input.
+#ifndef PME_JSON_EVENTS_H
+#define PME_JSON_EVENTS_H
+
+#include <pull.h>
+#include <condition_variable>
+#include <istream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace JSON {
+
+// An event as kept in a batch: its text is "length" bytes at "offset".
+struct Token {
+    EventType type;
+    bool decoded; // the text is in the batch's "decoded" rather than its "input".
+    uint32_t offset;
+    uint32_t length;
+    uint32_t start; // where the event starts in "input", for error messages.
+};
+
+/*
+ * The events for a block of input, so a consumer can go through them in a
+ * tight loop of its own rather than having its code interleaved with the
+ * tokenizer's, and so the two can run on different threads. The block
+ * holds any unfinished token from the block before it, so every event's
+ * text is in "input", apart from strings with escapes, which are unescaped
+ * into "decoded".
+ */
+struct EventBatch {
+    std::string input;
+    std::string decoded;
+    std::vector<Token> tokens;
+    size_t base = 0; // where "input" starts in the stream.
+    bool end = false; // the value is complete, or there's an error.
+    ParseError error;
+
+    std::string_view text(const Token &token) const {
+        return std::string_view((token.decoded ? decoded : input).data() + token.offset, token.length);
+    }
+    Event event(const Token &token) const {
+        return Event{ token.type, text(token), base + token.start };
+    }
+};
+
+// Turn a stream holding one JSON value into batches of events.
+class Tokenizer {
+    std::istream *in;
+    PullParser parser;
+    std::string carry; // an unfinished token, for the next block.
+    size_t blockSize;
+    bool eof = false;
+    bool ended = false;
+public:
+    Tokenizer(std::istream &in_, size_t blockSize_ = 1 << 16)
+        : in(&in_), parser(std::string_view(), false), blockSize(blockSize_) {}
+
+    // Start on a new value from "in_", keeping the storage we've grown.
+    void reset(std::istream &in_, size_t blockSize_) {
+        in = &in_;
+        parser.reset(std::string_view(), false);
+        carry.clear();
+        blockSize = blockSize_;
+        eof = ended = false;
+    }
+
+    // Fill "batch" with the events of the next block; false once there are no more.
+    bool fill(EventBatch &batch);
+};
+
+inline bool
+Tokenizer::fill(EventBatch &batch)
+{
+    if (ended)
+        return false;
+    batch.tokens.clear();
+    batch.decoded.clear();
+    batch.input.swap(carry);
+    batch.base = parser.offset();
+    batch.error = ParseError();
+    // Read until we have at least one whole event, however big it is.
+    do {
+        size_t have = batch.input.size();
+        batch.input.resize(have + blockSize);
+        in->read(&batch.input[have], blockSize);
+        batch.input.resize(have + in->gcount());
+        if (in->bad()) {
+            batch.error.code = Errc::ReadFailed;
+            batch.error.detail = "failed reading input";
+            batch.error.offset = batch.base + have; // what the failed read got is lost.
+            batch.end = ended = true;
+            return true;
+        }
+        eof = in->eof();
+        parser.refill(batch.input, eof);
+        Event event;
+        const char *start = batch.input.data(), *stop = start + batch.input.size();
+        while (parser.next(event)) {
+            const char *text = event.text.data();
+            uint32_t at = uint32_t(event.offset - batch.base);
+            if (event.text.empty() || (text >= start && text < stop)) {
+                batch.tokens.push_back({ event.type, false, uint32_t(event.text.empty() ? 0 : text - start),
+                        uint32_t(event.text.size()), at });
+            } else {
+                batch.tokens.push_back({ event.type, true, uint32_t(batch.decoded.size()),
+                        uint32_t(event.text.size()), at });
+                batch.decoded.append(event.text);
+            }
+        }
+    } while (batch.tokens.empty() && parser.starved() && !eof);
+    if (parser.starved() && !eof) {
+        carry.assign(batch.input, parser.used(), std::string::npos);
+        batch.input.resize(parser.used());
+        batch.end = false;
+    } else {
+        batch.error = parser.error();
+        batch.end = ended = true;
+    }
+    return true;
+}
+
+/*
+ * A consumer of events that needn't be a template, such as one loaded at
+ * run time. It's handed a batch at a time, so the virtual call costs once
+ * per batch rather than per event, and it goes through the events in a loop
+ * of its own, compiled with the rest of it.
+ */
+class EventHandler {
+public:
+    virtual ~EventHandler() {}
+    // Take the events of a batch, returning false (with "err" set) to stop.
+    virtual bool events(const EventBatch &batch, ParseError &err) = 0;
+};
+
+// Hand "batch" to "handler"; false if that's the end of them.
+inline bool
+deliverEvents(EventHandler &handler, const EventBatch &batch, ParseError &err)
+{
+    if (!handler.events(batch, err))
+        return false;
+    if (batch.end)
+        err = batch.error;
+    return !batch.end;
+}
+
+/*
+ * Parse the value "tokenizer" was set up for into batches for "handler" on
+ * this thread, filling "batch" each time. Keeping both for the next value
+ * saves growing their buffers again.
+ */
+inline bool
+parseEvents(Tokenizer &tokenizer, EventBatch &batch, EventHandler &handler, ParseError &err)
+{
+    while (tokenizer.fill(batch) && deliverEvents(handler, batch, err))
+        ;
+    return !err;
+}
+
+/*
+ * Parse the JSON value in "in" into batches for "handler", returning false
+ * if it's invalid or the handler stops. If "threaded", the tokenizer runs on
+ * a thread of its own, up to a few batches ahead of the handler.
+ */
+inline bool
+parseEvents(std::istream &in, EventHandler &handler, ParseError &err, bool threaded = false)
+{
+    Tokenizer tokenizer(in);
+    if (!threaded) {
+        EventBatch batch;
+        return parseEvents(tokenizer, batch, handler, err);
+    }
+    const size_t depth = 4;
+    EventBatch batches[depth];
+    size_t filled = 0, delivered = 0;
+    bool stop = false;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread producer([&] () -> void {
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> hold(lock);
+                changed.wait(hold, [&] { return stop || filled - delivered < depth; });
+                if (stop)
+                    return;
+            }
+            EventBatch &batch = batches[filled % depth];
+            bool more = tokenizer.fill(batch) && !batch.end;
+            std::lock_guard<std::mutex> hold(lock);
+            ++filled;
+            changed.notify_all();
+            if (!more)
+                return;
+        }
+    });
+    for (bool more = true; more;) {
+        {
+            std::unique_lock<std::mutex> hold(lock);
+            changed.wait(hold, [&] { return filled > delivered; });
+        }
+        more = deliverEvents(handler, batches[delivered % depth], err);
+        std::lock_guard<std::mutex> hold(lock);
+        ++delivered;
+        stop = !more;
+        changed.notify_all();
+    }
+    producer.join();
+    return !err;
+}
+
+}
+#endif
@@ -0,0 +1,387 @@
+// The formatter: indent a JSON document as it's parsed.
+#include <jdent.h>
+#include <events.h>
+#include <path.h>
+#include <cstring>
+#include <string>
+
+using namespace JSON;
+using namespace std;
+
+/*
+ * Everything here reports bad input through ParseError rather than
+ * exceptions, so it can be built with -fno-exceptions, and NDJSON with many
+ * bad records doesn't spend its time unwinding.
+ */
+bool doFloat;
+PathTrie redactions;
+Checkpoint *tracking;
+
+static const char *pad(size_t indent) {
+    static size_t maxindent = 8192;
+    static const char *spaces = strdup(string(maxindent, ' ').c_str());
+    indent = min(4 * indent, maxindent);
+    return spaces + maxindent - indent;
+}
+
+template <typename numtype>
+static bool pretty(istream &i, ostream &o, size_t indent, const PathTrie::Node *redact, ParseError &err);
+
+/*
+ * The "redact" trie node follows the value being formatted through the
+ * paths given to --redact; it's null when nothing below can match. A
+ * non-zero "eleCount" continues an array or object after that many
+ * elements, when resuming from a checkpoint.
+ */
+template <typename numtype> static bool
+prettyArray(istream &i, ostream &o, size_t indent, const PathTrie::Node *redact, ParseError &err,
+        size_t eleCount = 0)
+{
+    auto element = [=, &eleCount, &o, &err] (istream &i) -> bool {
+        const PathTrie::Node *child = redact ? redact->child(to_string(eleCount)) : nullptr;
+        o << (eleCount++ ? "," : "") << "\n" << pad(indent + 1);
+        if (!pretty<numtype>(i, o, indent+1, child, err))
+            return false;
+        if (tracking) {
+            tracking->stack.back().count = eleCount;
+            checkpointDue(i, o);
+        }
+        return true;
+    };
+    bool ok;
+    if (eleCount == 0) {
+        o << "[";
+        if (tracking)
+            tracking->stack.push_back({ false, 0, string() });
+        ok = parseArray(i, element, err);
+    } else {
+        ok = continueArray(i, element, err);
+    }
+    if (!ok)
+        return false;
+    if (tracking)
+        tracking->stack.pop_back();
+    if (eleCount)
+        o << "\n" << pad(indent);
+    o << "]";
+    return true;
+}
+
+template <typename numtype> static bool
+prettyObject(istream &i, ostream &o, size_t indent, const PathTrie::Node *redact, ParseError &err,
+        size_t eleCount = 0)
+{
+    auto element = [=, &eleCount, &o, &err] (istream &i, const string &idx) -> bool {
+        if (eleCount++ != 0)
+            o << ",";
+        o << "\n" << pad(indent + 1) << "\"";
+        if (!writeEscaped(o, idx))
+            return parseFailed(i, err, Errc::BadString, "illegal character in multibyte sequence");
+        o << "\": ";
+        if (tracking)
+            tracking->stack.back().key = idx;
+        if (!pretty<numtype>(i, o, indent + 1, redact ? redact->child(idx) : nullptr, err))
+            return false;
+        if (tracking) {
+            tracking->stack.back().count = eleCount;
+            checkpointDue(i, o);
+        }
+        return true;
+    };
+    bool ok;
+    if (eleCount == 0) {
+        o << "{";
+        if (tracking)
+            tracking->stack.push_back({ true, 0, string() });
+        ok = parseObject(i, element, err);
+    } else {
+        ok = continueObject(i, element, err);
+    }
+    if (!ok)
+        return false;
+    if (tracking)
+        tracking->stack.pop_back();
+    if (eleCount)
+        o << "\n" << pad(indent);
+    o << "}";
+    return true;
+}
+
+/*
+ * Carry on formatting from a checkpoint: finish the element in progress at
+ * "depth" in the stack (if it's not the innermost level), then the rest of
+ * the container there.
+ */
+template <typename numtype> static bool
+resumePretty(istream &i, ostream &o, size_t depth, const PathTrie::Node *redact, ParseError &err)
+{
+    Checkpoint::Level level = tracking->stack[depth];
+    if (depth + 1 < tracking->stack.size()) {
+        const PathTrie::Node *child = redact
+            ? redact->child(level.object ? level.key : to_string(level.count)) : nullptr;
+        if (!resumePretty<numtype>(i, o, depth + 1, child, err))
+            return false;
+        tracking->stack[depth].count = ++level.count;
+    }
+    if (level.object)
+        return prettyObject<numtype>(i, o, depth, redact, err, level.count);
+    else
+        return prettyArray<numtype>(i, o, depth, redact, err, level.count);
+}
+
+static bool
+prettyString(istream &i, ostream &o, size_t indent, ParseError &err)
+{
+    string value;
+    if (!parseString(i, value, err))
+        return false;
+    o << "\"";
+    if (!writeEscaped(o, value))
+        return parseFailed(i, err, Errc::BadString, "illegal character in multibyte sequence");
+    o << "\"";
+    return true;
+}
+
+static bool
+prettyNull(istream &i, ostream &o, size_t indent, ParseError &err)
+{
+    if (!parseNull(i, err))
+        return false;
+    o.write("null", 4);
+    return true;
+}
+
+/*
+ * Unless we're parsing floats, numbers are written just as they were read,
+ * so integers too big for us, or fractions, lose nothing on the way.
+ */
+template <typename numtype> static bool
+prettyNumber(istream &i, ostream &o, size_t indent, ParseError &err)
+{
+    if constexpr (is_floating_point<numtype>::value) {
+        numtype value;
+        if (!parseFloat(i, value, err))
+            return false;
+        o << value;
+    } else {
+        NumberText text;
+        if (!parseNumberText(i, text, err))
+            return false;
+        o.write(text.data(), text.size());
+    }
+    return true;
+}
+
+static bool
+prettyBoolean(istream &i, ostream &o, size_t indent, ParseError &err)
+{
+    static const char *const words[] = { "false", "true" };
+    bool value;
+    if (!parseBoolean(i, value, err))
+        return false;
+    o.write(words[value], 5 - value);
+    return true;
+}
+
+template <typename numtype> static bool
+pretty(istream &i, ostream &o, size_t indent, const PathTrie::Node *redact, ParseError &err)
+{
+    if (redact && redact->leaf != -1) {
+        if (!parseValue(i, err)) // skip the whole subtree.
+            return false;
+        o << "\"***\"";
+        return true;
+    }
+    switch (peekType(i, err)) {
+        case Array: return prettyArray<numtype>(i, o, indent, redact, err);
+        case Object: return prettyObject<numtype>(i, o, indent, redact, err);
+        case String: return prettyString(i, o, indent, err);
+        case Number: return prettyNumber<numtype>(i, o, indent, err);
+        case Boolean: return prettyBoolean(i, o, indent, err);
+        case Null: return prettyNull(i, o, indent, err);
+        case Eof: return true;
+        default: return false;
+    }
+}
+
+// Deal with UTF-8 BOM mark. (Lordy, why would you do that?)
+static bool
+skipBom(istream &in)
+{
+    static unsigned char bom[] = { 0xef, 0xbb, 0xbf };
+
+    if (in.peek() == bom[0]) {
+        char s[sizeof bom + 1];
+        in.get(s, sizeof s);
+        if (memcmp(s, bom, sizeof bom) != 0)
+            return false;
+    }
+    return true;
+}
+
+string
+indentDocument(istream &in, ostream &out)
+{
+    return indentDocument(in, out, doFloat);
+}
+
+string
+indentDocument(istream &in, ostream &out, bool floats)
+{
+    if (!skipBom(in))
+        return "invalid BOM/JSON";
+    const PathTrie::Node *redact = redactions.size() ? &redactions.root : nullptr;
+    ParseError err;
+    if (!(floats ? pretty<double>(in, out, 0, redact, err) : pretty<long>(in, out, 0, redact, err)))
+        return err.message();
+    out << "\n";
+    return string();
+}
+
+string
+resumeDocument(istream &in, ostream &out)
+{
+    if (tracking->stack.empty())
+        return "checkpoint has no position in the document";
+    const PathTrie::Node *redact = redactions.size() ? &redactions.root : nullptr;
+    ParseError err;
+    if (!(doFloat ? resumePretty<double>(in, out, 0, redact, err) : resumePretty<long>(in, out, 0, redact, err)))
+        return err.message();
+    out << "\n";
+    return string();
+}
+
+// The only thing the formatter can find wrong with an event.
+static bool
+escapeFailed(const Event &e, ParseError &err)
+{
+    err.code = Errc::BadString;
+    err.detail = "illegal character in multibyte sequence";
+    err.offset = e.offset;
+    return false;
+}
+
+EventFormatter::EventFormatter(ostream &out_, bool floats_)
+    : out(out_), floats(floats_), redact(redactions.size() ? &redactions.root : nullptr)
+{
+}
+
+bool
+EventFormatter::event(const Event &e, ParseError &err)
+{
+    bool begin = e.type == EventType::BeginObject || e.type == EventType::BeginArray;
+    bool end = e.type == EventType::EndObject || e.type == EventType::EndArray;
+    if (skipping) {
+        skipping = begin ? skipping + 1 : end ? skipping - 1 : skipping;
+        finished = skipping == 0 && stack.empty();
+        return true;
+    }
+    if (end) {
+        size_t count = stack.back().count;
+        stack.pop_back();
+        if (count)
+            out << "\n" << pad(stack.size());
+        out << (e.type == EventType::EndObject ? "}" : "]");
+        finished = stack.empty();
+        return true;
+    }
+    if (e.type == EventType::Key) {
+        Level &level = stack.back();
+        if (level.count++ != 0)
+            out << ",";
+        out << "\n" << pad(stack.size()) << "\"";
+        text.assign(e.text);
+        if (!writeEscaped(out, text))
+            return escapeFailed(e, err);
+        out << "\": ";
+        redact = level.redact ? level.redact->child(text) : nullptr;
+        return true;
+    }
+    if (!stack.empty() && !stack.back().object) {
+        Level &level = stack.back();
+        redact = level.redact ? level.redact->child(to_string(level.count)) : nullptr;
+        out << (level.count++ ? "," : "") << "\n" << pad(stack.size());
+    }
+    if (redact && redact->leaf != -1) {
+        out << "\"***\"";
+        skipping = begin;
+        finished = !begin && stack.empty();
+        return true;
+    }
+    switch (e.type) {
+        case EventType::BeginObject:
+        case EventType::BeginArray:
+            out << (e.type == EventType::BeginObject ? "{" : "[");
+            stack.push_back({ e.type == EventType::BeginObject, 0, redact });
+            return true;
+        case EventType::String:
+            out << "\"";
+            text.assign(e.text);
+            if (!writeEscaped(out, text))
+                return escapeFailed(e, err);
+            out << "\"";
+            break;
+        case EventType::Number:
+            if (floats) {
+                number.reset(e.text.data(), e.text.size());
+                double value;
+                if (!parseFloat(number, value, err))
+                    return false;
+                out << value;
+                break;
+            }
+            // fall through
+        default:
+            out.write(e.text.data(), e.text.size());
+            break;
+    }
+    finished = stack.empty();
+    return true;
+}
+
+namespace {
+
+// The formatter as an EventHandler, for --batched.
+class BatchFormatter : public EventHandler {
+    EventFormatter formatter;
+public:
+    BatchFormatter(ostream &out) : formatter(out, doFloat) {}
+    bool events(const EventBatch &batch, ParseError &err) override {
+        for (const Token &token : batch.tokens)
+            if (!formatter.event(batch.event(token), err))
+                return false;
+        return true;
+    }
+};
+
+}
+
+string
+indentBatched(istream &in, ostream &out, bool threaded)
+{
+    if (!skipBom(in))
+        return "invalid BOM/JSON";
+    BatchFormatter formatter(out);
+    ParseError err;
+    if (!parseEvents(in, formatter, err, threaded))
+        return err.message();
+    out << "\n";
+    return string();
+}
+
+string
+indentBatchedRecord(istream &in, size_t size, ostream &out)
+{
+    static Tokenizer tokenizer(in);
+    static EventBatch batch;
+    if (!skipBom(in))
+        return "invalid BOM/JSON";
+    // One more than the record, so the first read sees its end.
+    tokenizer.reset(in, size + 1);
+    BatchFormatter formatter(out);
+    ParseError err;
+    if (!parseEvents(tokenizer, batch, formatter, err))
+        return err.message();
+    out << "\n";
+    return string();
+}
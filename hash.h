@@ -0,0 +1,100 @@
+// 128-bit non-cryptographic hashing (MurmurHash3, x64 128-bit variant.)
+#ifndef PME_HASH_H
+#define PME_HASH_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+struct Hash128 {
+    uint64_t hi, lo;
+    bool operator == (const Hash128 &rhs) const { return hi == rhs.hi && lo == rhs.lo; }
+    bool operator != (const Hash128 &rhs) const { return !(*this == rhs); }
+    bool operator < (const Hash128 &rhs) const { return hi < rhs.hi || (hi == rhs.hi && lo < rhs.lo); }
+    std::string hex() const {
+        static const char digits[] = "0123456789abcdef";
+        std::string rv(32, '0');
+        for (int i = 0; i < 16; ++i) {
+            rv[i] = digits[(hi >> (60 - 4 * i)) & 0xf];
+            rv[16 + i] = digits[(lo >> (60 - 4 * i)) & 0xf];
+        }
+        return rv;
+    }
+};
+
+namespace HashDetail {
+
+static inline uint64_t rotl(uint64_t x, int r) { return x << r | x >> (64 - r); }
+
+static inline uint64_t fmix(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+}
+
+static inline Hash128
+hash128(const void *data, size_t len, uint64_t seed = 0)
+{
+    using namespace HashDetail;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    uint64_t h1 = seed, h2 = seed;
+
+    size_t blocks = len / 16;
+    for (size_t i = 0; i < blocks; ++i, p += 16) {
+        uint64_t k1, k2;
+        memcpy(&k1, p, 8);
+        memcpy(&k2, p + 8, 8);
+        k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    uint64_t k1 = 0, k2 = 0;
+    switch (len & 15) {
+        case 15: k2 ^= uint64_t(p[14]) << 48; // fallthrough
+        case 14: k2 ^= uint64_t(p[13]) << 40; // fallthrough
+        case 13: k2 ^= uint64_t(p[12]) << 32; // fallthrough
+        case 12: k2 ^= uint64_t(p[11]) << 24; // fallthrough
+        case 11: k2 ^= uint64_t(p[10]) << 16; // fallthrough
+        case 10: k2 ^= uint64_t(p[9]) << 8; // fallthrough
+        case 9: k2 ^= uint64_t(p[8]);
+            k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+            // fallthrough
+        case 8: k1 ^= uint64_t(p[7]) << 56; // fallthrough
+        case 7: k1 ^= uint64_t(p[6]) << 48; // fallthrough
+        case 6: k1 ^= uint64_t(p[5]) << 40; // fallthrough
+        case 5: k1 ^= uint64_t(p[4]) << 32; // fallthrough
+        case 4: k1 ^= uint64_t(p[3]) << 24; // fallthrough
+        case 3: k1 ^= uint64_t(p[2]) << 16; // fallthrough
+        case 2: k1 ^= uint64_t(p[1]) << 8; // fallthrough
+        case 1: k1 ^= uint64_t(p[0]);
+            k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix(h1);
+    h2 = fmix(h2);
+    h1 += h2;
+    h2 += h1;
+    return Hash128{ h1, h2 };
+}
+
+static inline Hash128
+hash128(const std::string &s, uint64_t seed = 0)
+{
+    return hash128(s.data(), s.size(), seed);
+}
+
+#endif
@@ -1,150 +1,506 @@
-#include <json.h>
-#include <fstream>
+#include <jdent.h>
+#include <path.h>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <fcntl.h>
+#include <getopt.h>
+#include <thread>
+#include <sys/stat.h>
 #include <unistd.h>
 
 using namespace JSON;
 using namespace std;
 
-const char *pad(size_t indent) {
-    static size_t maxindent = 8192;
-    static const char *spaces = strdup(string(maxindent, ' ').c_str());
-    indent = min(4 * indent, maxindent);
-    return spaces + maxindent - indent;
-}
-
-template <typename numtype>
-static void pretty(istream &i, ostream &o, size_t indent);
-
-template <typename numtype> void
-prettyArray(istream &i, ostream &o, size_t indent)
-{
-    o << "[";
-    size_t eleCount = 0;
-    parseArray(i, [=, &eleCount, &o] (istream &i) -> void {
-        o << (eleCount++ ? "," : "") << "\n" << pad(indent + 1);
-        pretty<numtype>(i, o, indent+1);
-    });
-    if (eleCount)
-        o << "\n" << pad(indent);
-    o << "]";
-}
-
-template <typename numtype> static void
-prettyObject(istream &i, ostream &o, size_t indent)
-{
-    o << "{";
-    int eleCount = 0;
-    parseObject(i, [=, &eleCount, &o] (istream &i, string idx) -> void {
-        if (eleCount++ != 0)
-            o << ",";
-        o << "\n" << pad(indent + 1) << "\"" << Escape(idx) << "\": ";
-        pretty<numtype>(i, o, indent + 1);
-    });
-    if (eleCount)
-        o << "\n" << pad(indent);
-    o << "}";
-}
-
 static void
-prettyString(istream &i, ostream &o, size_t indent)
+printStats()
 {
-    o << "\"" << Escape(parseString(i)) << "\"";
+    printBufferStats(clog);
 }
 
-static void
-prettyNull(istream &i, ostream &o, size_t indent)
-{
-    parseNull(i);
-    o << "null";
+static int
+usage() {
+    clog << "usage: jdent [ -f ] [ --redact path,... ] [ files ... ]" << endl
+         << "       jdent [ -f ] -i [ -j threads ] files ..." << endl
+         << "       jdent [ -f ] --top K path [ files ... ]" << endl
+         << "       jdent --dedup [ --dedup-canonical ] [ --dedup-key path ]" << endl
+         << "             [ --dedup-mem MiB ] [ --spill-dir dir ] [ files ... ]" << endl
+         << "       jdent --partition-by path [ --out-dir dir ] [ --max-open N ]" << endl
+         << "             [ -j threads ] [ files ... ]" << endl
+         << "       jdent { --csv | --tsv } path,... [ --no-header ] [ -j threads ] [ files ... ]" << endl
+         << "       jdent --columnar file [ --columns path,... ] [ --sample N ]" << endl
+         << "             [ --row-group N ] [ -j threads ] [ files ... ]" << endl
+         << "       jdent [ -f ] --files-from list [ --out-suffix ext ] [ -j threads ]" << endl
+         << "       jdent --serve socket [ -j threads ]" << endl
+         << "       jdent [ -f ] --client socket [ files ... ]" << endl
+         << "       jdent [ -f ] --follow file" << endl
+         << "       jdent [ -f ] [ -n ] --checkpoint file [ --checkpoint-every MiB ] [ --resume ]" << endl
+         << "             -o output input" << endl
+         << "options: --cache-dir dir [ --cache-key stat|content ] reuses earlier output" << endl
+         << "         -o file writes output to file rather than stdout" << endl
+         << "         --input-mem MiB bounds how much of each input file is kept in memory" << endl
+         << "         --huge-pages thp|hugetlb|off chooses how large buffers are backed" << endl
+         << "         --stats reports on memory use when done" << endl
+         << "         -n indents each line of NDJSON input as a document of its own" << endl
+         << "         --concat takes records to be JSON values back to back, not lines" << endl
+         << "         --latency | --throughput flushes output after each document, or" << endl
+         << "           only when buffers fill (the default unless stdout is a terminal)" << endl
+         << "         --idle-flush ms flushes output when input stalls in latency mode" << endl
+         << "         --batched parses documents into batches of events, on a thread of" << endl
+         << "           their own unless -j 1" << endl;
+    return 2;
 }
 
-template <typename numtype> static void
-prettyNumber(istream &i, ostream &o, size_t indent)
-{
-    o << parseNumber<numtype>(i);
-}
+// In latency mode, flushes our output, for inputs to call when they stall.
+static function<void()> flushOutput;
 
-static void
-prettyBoolean(istream &i, ostream &o, size_t indent)
+bool
+forEachInput(const Inputs &inputs, const InputFn &fn)
 {
-    o << (parseBoolean(i) ? "true" : "false");
+    bool good = true;
+    for (auto name : inputs) {
+        auto inFile = openInput(name, flushOutput);
+        if (inFile) {
+            fn(*inFile, strcmp(name, "-") != 0 ? name : "<stdin>");
+        } else {
+            clog << "failed to open " << name
+                    << ": " << strerror(errno) << endl;
+            good = false;
+        }
+    }
+    return good;
 }
 
-template <typename numtype> static void
-pretty(istream &i, ostream &o, size_t indent)
+void
+runThreads(unsigned n, const function<void(unsigned)> &fn)
 {
-    switch (peekType(i)) {
-        case Array: prettyArray<numtype>(i, o, indent); return;
-        case Object: prettyObject<numtype>(i, o, indent); return;
-        case String: prettyString(i, o, indent); return;
-        case Number: prettyNumber<numtype>(i, o, indent); return;
-        case Boolean: prettyBoolean(i, o, indent); return;
-        case Null: prettyNull(i, o, indent); return;
-        case Eof: return;
+    vector<exception_ptr> errors(n);
+    vector<thread> threads;
+    for (unsigned i = 1; i < n; ++i) {
+        threads.emplace_back([i, &fn, &errors] () -> void {
+            try {
+                fn(i);
+            }
+            catch (...) {
+                errors[i] = current_exception();
+            }
+        });
+    }
+    try {
+        fn(0);
     }
+    catch (...) {
+        errors[0] = current_exception();
+    }
+    for (auto &t : threads)
+        t.join();
+    for (auto &error : errors)
+        if (error)
+            rethrow_exception(error);
 }
 
-static int
-usage() {
-    clog << "usage: jdent [ -f ] [ files ... ]" << endl;
-}
+static bool records;
+static bool lowLatency;
+static bool batched;
+static bool batchThread; // tokenize on a thread of its own with --batched.
 
-static bool doFloat;
+/*
+ * With --checkpoint, "checkpoint" is saved to "checkpointPath" each time
+ * we've read another "checkpointEvery" bytes of input, once the output it
+ * accounts for is safely on disk.
+ */
+static Checkpoint *checkpoint;
+static const char *checkpointPath;
+static size_t checkpointEvery = size_t(1) << 30;
+static size_t nextCheckpoint;
+static OutputBuf *checkpointOut;
+
+void
+checkpointDue(istream &in, ostream &out)
+{
+    streamoff offset = in.tellg();
+    if (offset < 0 || size_t(offset) < nextCheckpoint)
+        return;
+    nextCheckpoint = offset + checkpointEvery;
+    out.flush();
+    checkpoint->inputOffset = offset;
+    checkpoint->outputOffset = checkpointOut->bytesWritten();
+    string error;
+    if (!checkpointOut->persist())
+        error = string("failed to sync output: ") + strerror(errno);
+    else
+        checkpoint->save(checkpointPath, error);
+    if (!error.empty())
+        clog << error << endl; // the last checkpoint saved is still good.
+}
 
 static bool
 indent(istream &in, ostream &out)
 {
-    static unsigned char bom[] = { 0xef, 0xbb, 0xbf };
-
-    // Deal with UTF-8 BOM mark. (Lordy, why would you do that?)
-    if (in.peek() == bom[0]) {
-        char s[sizeof bom + 1];
-        in.get(s, sizeof s);
-        if (memcmp(s, bom, sizeof bom) != 0)
-            throw InvalidJSON("invalid BOM/JSON");
-    }
-    try {
-        if (doFloat)
-            pretty<double> (in, out, 0);
-        else
-            pretty<long> (in, out, 0);
-        cout << endl;
+    string error = batched ? indentBatched(in, out, batchThread) : indentDocument(in, out);
+    if (lowLatency)
+        out.flush();
+    if (error.empty())
         return true;
-    }
-    catch (const InvalidJSON &je) {
-        cerr << "invalid JSON: " << je.what() << endl;
-        return false;
-    }
+    cerr << "invalid JSON: " << error << endl;
+    return false;
 }
 
+/*
+ * Indent each record of an NDJSON stream as a document of its own. A bad
+ * record is reported, by its input's name and record number, and left out,
+ * and we carry on with the next line.
+ */
+static bool
+indentRecords(istream &in, ostream &out, const char *name)
+{
+    bool good = true;
+    unsigned long recordNo = 0;
+    MemoryStream record;
+    string formatted;
+    StringBuf formattedBuf(formatted);
+    ostream formattedOut(&formattedBuf);
+    forEachRecord(in, [&] (string &line) -> void {
+        ++recordNo;
+        record.reset(line);
+        formatted.clear();
+        string error = batched ? indentBatchedRecord(record, line.size(), formattedOut)
+            : indentDocument(record, formattedOut);
+        if (error.empty()) {
+            out << formatted;
+        } else {
+            cerr << name << ":" << recordNo << ": invalid JSON: " << error << endl;
+            good = false;
+        }
+        if (lowLatency)
+            out.flush();
+        if (checkpoint)
+            checkpointDue(in, out);
+    });
+    return good;
+}
+
+static const struct option longOptions[] = {
+    { "top", required_argument, 0, 'T' },
+    { "dedup", no_argument, 0, 'D' },
+    { "dedup-canonical", no_argument, 0, 'C' },
+    { "dedup-key", required_argument, 0, 'K' },
+    { "dedup-mem", required_argument, 0, 'M' },
+    { "spill-dir", required_argument, 0, 'S' },
+    { "redact", required_argument, 0, 'R' },
+    { "partition-by", required_argument, 0, 'P' },
+    { "out-dir", required_argument, 0, 'O' },
+    { "max-open", required_argument, 0, 'N' },
+    { "csv", required_argument, 0, 'c' },
+    { "tsv", required_argument, 0, 't' },
+    { "no-header", no_argument, 0, 'H' },
+    { "columnar", required_argument, 0, 'L' },
+    { "columns", required_argument, 0, 'l' },
+    { "sample", required_argument, 0, 's' },
+    { "row-group", required_argument, 0, 'g' },
+    { "files-from", required_argument, 0, 'F' },
+    { "out-suffix", required_argument, 0, 'x' },
+    { "serve", required_argument, 0, 'V' },
+    { "client", required_argument, 0, 'I' },
+    { "cache-dir", required_argument, 0, 'A' },
+    { "cache-key", required_argument, 0, 'k' },
+    { "input-mem", required_argument, 0, 'm' },
+    { "huge-pages", required_argument, 0, 'G' },
+    { "ndjson", no_argument, 0, 'n' },
+    { "latency", no_argument, 0, 'Y' },
+    { "throughput", no_argument, 0, 'y' },
+    { "idle-flush", required_argument, 0, 'W' },
+    { "follow", required_argument, 0, 'U' },
+    { "checkpoint", required_argument, 0, 'Q' },
+    { "checkpoint-every", required_argument, 0, 'q' },
+    { "resume", no_argument, 0, 'Z' },
+    { "stats", no_argument, 0, 'X' },
+    { "batched", no_argument, 0, 'B' },
+    { "concat", no_argument, 0, 'J' },
+    { 0, 0, 0, 0 }
+};
+
 int
 main(int argc, char *argv[])
 {
     cin.tie(0);
     int c;
-    while ((c = getopt(argc, argv, "f")) != -1) {
+    size_t topCount = 0;
+    const char *topPath = 0;
+    bool dedup = false;
+    DedupOptions dedupOpts;
+    PartitionOptions partitionOpts;
+    CsvOptions csvOpts;
+    ColumnarOptions columnarOpts;
+    BatchOptions batchOpts;
+    const char *servePath = 0;
+    const char *clientPath = 0;
+    const char *cacheDir = 0;
+    bool cacheByContent = false;
+    string redactPaths;
+    unsigned threads = max(thread::hardware_concurrency(), 1U);
+    bool inPlace = false;
+    const char *outPath = 0;
+    const char *followPath = 0;
+    bool resume = false;
+    lowLatency = isatty(STDOUT_FILENO);
+    while ((c = getopt_long(argc, argv, "fij:no:", longOptions, 0)) != -1) {
         switch (c) {
             case 'f': doFloat = true; break;
+            case 'i': inPlace = true; break;
+            case 'o': outPath = optarg; break;
+            case 'n': records = true; break;
+            case 'Y': lowLatency = true; break;
+            case 'y': lowLatency = false; break;
+            case 'W': FdInputBuf::idleTimeout = strtol(optarg, 0, 0); break;
+            case 'U': followPath = optarg; break;
+            case 'Q': checkpointPath = optarg; break;
+            case 'q': checkpointEvery = max(strtoul(optarg, 0, 0), 1UL) << 20; break;
+            case 'Z': resume = true; break;
+            case 'm': MappedInputBuf::limit = max(strtoul(optarg, 0, 0), 1UL) << 20; break;
+            case 'j': threads = max(strtoul(optarg, 0, 0), 1UL); break;
+            case 'T':
+                // --top K path: the path is the next argument.
+                if (optind == argc)
+                    return usage();
+                topCount = strtoul(optarg, 0, 0);
+                topPath = argv[optind++];
+                break;
+            case 'D': dedup = true; break;
+            case 'C': dedup = dedupOpts.canonical = true; break;
+            case 'K': dedup = true; dedupOpts.key = optarg; break;
+            case 'M': dedupOpts.memLimit = strtoul(optarg, 0, 0) << 20; break;
+            case 'S': dedupOpts.spillDir = optarg; break;
+            case 'R': {
+                istringstream paths(optarg);
+                for (string path; getline(paths, path, ',');)
+                    redactions.add(path);
+                redactPaths = redactPaths + optarg + ",";
+                break;
+            }
+            case 'P': partitionOpts.path = optarg; break;
+            case 'O': partitionOpts.outDir = optarg; break;
+            case 'N': partitionOpts.maxOpen = strtoul(optarg, 0, 0); break;
+            case 'c': case 't': {
+                csvOpts.sep = c == 't' ? '\t' : ',';
+                istringstream paths(optarg);
+                for (string path; getline(paths, path, ',');)
+                    csvOpts.columns.push_back(path);
+                break;
+            }
+            case 'H': csvOpts.header = false; break;
+            case 'L': columnarOpts.file = optarg; break;
+            case 'l': {
+                istringstream paths(optarg);
+                for (string path; getline(paths, path, ',');)
+                    columnarOpts.columns.push_back(path);
+                break;
+            }
+            case 's': columnarOpts.sampleSize = strtoul(optarg, 0, 0); break;
+            case 'g': columnarOpts.rowGroupSize = strtoul(optarg, 0, 0); break;
+            case 'F': batchOpts.list = optarg; break;
+            case 'x': batchOpts.suffix = optarg; break;
+            case 'V': servePath = optarg; break;
+            case 'I': clientPath = optarg; break;
+            case 'A': cacheDir = optarg; break;
+            case 'k':
+                if (strcmp(optarg, "content") == 0)
+                    cacheByContent = true;
+                else if (strcmp(optarg, "stat") != 0)
+                    return usage();
+                break;
+            case 'G':
+                if (strcmp(optarg, "off") == 0)
+                    hugePages = HugePages::Off;
+                else if (strcmp(optarg, "hugetlb") == 0)
+                    hugePages = HugePages::HugeTLB;
+                else if (strcmp(optarg, "thp") != 0)
+                    return usage();
+                break;
+            case 'X':
+                bufferStats = true;
+                atexit(printStats);
+                break;
+            case 'B': batched = true; break;
+            case 'J': concatenated = records = true; break;
             default: return usage();
         }
     }
-    bool good = true;
-    for (int i = optind; i < argc; ++i) {
-        if (strcmp(argv[i], "-") != 0) {
-            ifstream inFile;
-            inFile.open(argv[i]);
-            if (inFile.good())
-                good = good && indent(inFile, cout);
-            else
-                clog << "failed to open " << argv[i]
-                        << ": " << strerror(errno) << endl;
+    batchThread = threads > 1;
+    Inputs inputs(argv + optind, argv + argc);
+    if (inPlace)
+        return inputs.empty() ? usage() : indentInPlace(inputs, threads) ? 0 : 1;
+    if (inputs.empty())
+        inputs.push_back("-");
+
+    if (followPath)
+        records = lowLatency = true;
+
+    // A checkpoint holds offsets into one input file and one output file.
+    Checkpoint saved;
+    if (checkpointPath) {
+        if (!outPath || inputs.size() != 1 || strcmp(inputs[0], "-") == 0) {
+            clog << "--checkpoint needs one input file, and output to a file with -o" << endl;
+            return 2;
+        }
+        if (concatenated) {
+            // The values are split from input read ahead of them.
+            clog << "--checkpoint can't be used with --concat" << endl;
+            return 2;
+        }
+        saved.input = inputs[0];
+        saved.options = string("float=") + (doFloat ? "1" : "0")
+            + ";redact=" + redactPaths + ";ndjson=" + (records ? "1" : "0");
+        if (resume) {
+            Checkpoint previous;
+            string error;
+            if (!previous.load(checkpointPath, error)) {
+                clog << error << endl;
+                return 1;
+            }
+            if (previous.input != saved.input || previous.options != saved.options) {
+                clog << checkpointPath << ": checkpoint is for other input or options" << endl;
+                return 1;
+            }
+            saved = previous;
+        }
+    } else if (resume) {
+        return usage();
+    }
+
+    // In latency mode, output is flushed after each record, and whenever
+    // we're left waiting for input.
+    unique_ptr<OutputBuf> outFile;
+    if (outPath) {
+        string error;
+        outFile.reset(openOutput(outPath, error, saved.outputOffset));
+        if (!outFile) {
+            clog << error << endl;
+            return 1;
+        }
+    } else {
+        outFile.reset(new FdOutputBuf(STDOUT_FILENO, lowLatency ? 1 << 12 : 2 << 20));
+    }
+    ostream out(outFile.get());
+    if (lowLatency)
+        flushOutput = [&out] () -> void { out.flush(); };
+    auto finish = [&] (bool good) -> int {
+        out.flush();
+        if (!outFile->finish()) {
+            clog << "failed writing " << (outPath ? outPath : "output")
+                 << ": " << strerror(errno) << endl;
+            good = false;
+        }
+        return good ? 0 : 1;
+    };
+
+    if (topPath)
+        return finish(topRecords(inputs, out, topCount, topPath));
+    if (dedup)
+        return finish(dedupRecords(inputs, out, dedupOpts));
+    if (partitionOpts.path) {
+        if (mkdir(partitionOpts.outDir.c_str(), 0777) == -1 && errno != EEXIST) {
+            clog << "failed to create " << partitionOpts.outDir << ": " << strerror(errno) << endl;
+            return 1;
+        }
+        partitionOpts.threads = threads;
+        return partitionRecords(inputs, partitionOpts) ? 0 : 1;
+    }
+    if (!csvOpts.columns.empty()) {
+        csvOpts.threads = threads;
+        return finish(csvRecords(inputs, out, csvOpts));
+    }
+    if (columnarOpts.file) {
+        columnarOpts.threads = threads;
+        return columnarRecords(inputs, columnarOpts) ? 0 : 1;
+    }
+    unique_ptr<OutputCache> cache;
+    if (cacheDir) {
+        if (mkdir(cacheDir, 0777) == -1 && errno != EEXIST) {
+            clog << "failed to create " << cacheDir << ": " << strerror(errno) << endl;
+            return 1;
+        }
+        ostringstream formatting;
+        formatting << "float=" << doFloat << ";redact=" << redactPaths;
+        cache.reset(new OutputCache(cacheDir, cacheByContent, formatting.str()));
+    }
+
+    if (servePath)
+        return serve(servePath, threads) ? 0 : 1;
+    if (clientPath)
+        return finish(client(clientPath, inputs, out, doFloat));
+    if (batchOpts.list) {
+        batchOpts.threads = threads;
+        batchOpts.cache = cache.get();
+        return finish(indentFiles(out, batchOpts));
+    }
+
+    if (checkpointPath) {
+        auto in = openInput(inputs[0]);
+        if (!in || (resume && !in->seekg(saved.inputOffset))) {
+            clog << "failed to open " << inputs[0] << ": " << strerror(errno) << endl;
+            return 1;
+        }
+        checkpoint = &saved;
+        checkpointOut = outFile.get();
+        nextCheckpoint = saved.inputOffset + checkpointEvery;
+        bool good;
+        if (records) {
+            good = indentRecords(*in, out, inputs[0]);
         } else {
-            good = good && indent(cin, cout);
+            tracking = &saved;
+            string error = resume ? resumeDocument(*in, out) : indentDocument(*in, out);
+            if (!error.empty())
+                cerr << "invalid JSON: " << error << endl;
+            good = error.empty();
         }
+        int rc = finish(good);
+        if (rc == 0)
+            unlink(checkpointPath); // the job's done.
+        return rc;
+    }
+
+    if (followPath) {
+        int fd = open(followPath, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            clog << "failed to open " << followPath << ": " << strerror(errno) << endl;
+            return 1;
+        }
+        FollowBuf buf(fd, followPath);
+        buf.onIdle = flushOutput;
+        istream in(&buf);
+        return finish(indentRecords(in, out, followPath));
+    }
+
+    bool good = true;
+    for (auto name : inputs) {
+        if (cache && !records && strcmp(name, "-") != 0) {
+            string error;
+            int fd = cache->get(name, error);
+            if (fd != -1) {
+                out.flush();
+                if (!(outPath ? copyFd(fd, out) : copyFd(fd, STDOUT_FILENO))) {
+                    clog << "failed writing output: " << strerror(errno) << endl;
+                    good = false;
+                }
+                close(fd);
+                continue;
+            }
+            if (!error.empty()) {
+                clog << name << ": " << error << endl;
+                good = false;
+                continue;
+            }
+        }
+        auto inFile = openInput(name, flushOutput);
+        if (inFile)
+            good = good && (records ? indentRecords(*inFile, out, strcmp(name, "-") != 0 ? name : "<stdin>")
+                    : indent(*inFile, out));
+        else
+            clog << "failed to open " << name
+                    << ": " << strerror(errno) << endl;
     }
-    if (optind == argc)
-        good = indent(cin, cout);
-    return good ? 0 : 1;
+    return finish(good);
 }
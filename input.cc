@@ -0,0 +1,343 @@
+// Input streams read through mappings of files.
+#include <jdent.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace JSON;
+using namespace std;
+
+bool concatenated;
+
+size_t MappedInputBuf::limit = 256 << 20;
+
+MappedInputBuf::MappedInputBuf(int fd_, const char *map_, size_t size_)
+    : fd(fd_), map(map_), size(size_), released(0), fetched(0)
+{
+    // Keep a quarter of the budget for the chunk being parsed, and the rest
+    // for what's coming.
+    size_t page = sysconf(_SC_PAGESIZE);
+    chunk = max(limit / 4 / page, size_t(1)) * page;
+    if (map) {
+        madvise(const_cast<char *>(map), size, MADV_SEQUENTIAL);
+        // Only honoured where the kernel can put file pages in huge pages.
+        if (hugePages != HugePages::Off)
+            madvise(const_cast<char *>(map), size, MADV_HUGEPAGE);
+    }
+    setg(0, 0, 0);
+}
+
+MappedInputBuf::~MappedInputBuf()
+{
+    if (map)
+        munmap(const_cast<char *>(map), size);
+    close(fd);
+}
+
+// Hand the reader the chunk starting at "start".
+void
+MappedInputBuf::window(size_t start)
+{
+    // Nothing before "start" will be read again. Both calls are advice, so
+    // failures just leave the pages where they are.
+    if (start > released) {
+        madvise(const_cast<char *>(map) + released, start - released, MADV_DONTNEED);
+        posix_fadvise(fd, released, start - released, POSIX_FADV_DONTNEED);
+        released = start;
+    }
+    size_t ahead = min(start + limit, size);
+    if (ahead > fetched) {
+        size_t from = max(fetched, start);
+        madvise(const_cast<char *>(map) + from, ahead - from, MADV_WILLNEED);
+        fetched = ahead;
+    }
+    char *p = const_cast<char *>(map) + start;
+    setg(p, p, p + min(chunk, size - start));
+}
+
+MappedInputBuf::int_type
+MappedInputBuf::underflow()
+{
+    size_t start = egptr() ? egptr() - map : 0;
+    if (!map || start >= size)
+        return traits_type::eof();
+    window(start);
+    return traits_type::to_int_type(*gptr());
+}
+
+MappedInputBuf::pos_type
+MappedInputBuf::seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which)
+{
+    off_type cur = gptr() ? gptr() - map : 0;
+    if (dir == ios_base::cur && off == 0)
+        return cur; // just asking where we are.
+    return seekpos(dir == ios_base::beg ? off : dir == ios_base::cur ? cur + off : size + off, which);
+}
+
+// Chunks stay aligned to their size, so we only ever release whole pages.
+MappedInputBuf::pos_type
+MappedInputBuf::seekpos(pos_type pos, ios_base::openmode)
+{
+    if (pos < 0 || size_t(pos) > size)
+        return pos_type(off_type(-1));
+    if (!map)
+        return pos;
+    size_t start = size_t(pos) - size_t(pos) % chunk;
+    released = min(released, start);
+    fetched = min(fetched, start);
+    if (start == size) {
+        setg(const_cast<char *>(map) + size, const_cast<char *>(map) + size,
+                const_cast<char *>(map) + size);
+        return pos;
+    }
+    window(start);
+    gbump(size_t(pos) - start);
+    return pos;
+}
+
+int FdInputBuf::idleTimeout = 200;
+
+FdInputBuf::FdInputBuf(int fd_, bool owned_, size_t size)
+    : buf(size), fd(fd_), owned(owned_)
+{
+    setg(0, 0, 0);
+}
+
+FdInputBuf::~FdInputBuf()
+{
+    if (owned)
+        close(fd);
+}
+
+FdInputBuf::int_type
+FdInputBuf::underflow()
+{
+    if (onIdle) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int rc;
+        while ((rc = poll(&pfd, 1, idleTimeout)) == -1 && errno == EINTR)
+            ;
+        if (rc == 0)
+            onIdle();
+    }
+    ssize_t rc;
+    while ((rc = read(fd, &buf[0], buf.size())) == -1 && errno == EINTR)
+        ;
+    if (rc <= 0)
+        return traits_type::eof();
+    setg(&buf[0], &buf[0], &buf[0] + rc);
+    return traits_type::to_int_type(buf[0]);
+}
+
+FdInputBuf::pos_type
+FdInputBuf::seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which)
+{
+    if (dir == ios_base::cur) {
+        off_t cur = lseek(fd, 0, SEEK_CUR);
+        if (cur == -1)
+            return pos_type(off_type(-1));
+        cur -= egptr() - gptr(); // what we've read, but not handed out.
+        return off == 0 ? pos_type(cur) : seekpos(cur + off, which);
+    }
+    setg(0, 0, 0);
+    return lseek(fd, off, dir == ios_base::beg ? SEEK_SET : SEEK_END);
+}
+
+FdInputBuf::pos_type
+FdInputBuf::seekpos(pos_type pos, ios_base::openmode)
+{
+    setg(0, 0, 0);
+    return lseek(fd, pos, SEEK_SET);
+}
+
+/*
+ * We watch the directory rather than the file: it reports writes to the file
+ * as well as a new file being created or moved in under its name.
+ */
+FollowBuf::FollowBuf(int fd_, const string &path_)
+    : FdInputBuf(fd_, true), path(path_)
+{
+    notify = inotify_init1(IN_CLOEXEC);
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    if (notify != -1 && inotify_add_watch(notify, dir.c_str(),
+                IN_MODIFY | IN_CREATE | IN_MOVED_TO) == -1) {
+        int error = errno;
+        close(notify);
+        notify = -1;
+        errno = error;
+    }
+    if (notify == -1)
+        clog << "can't watch " << dir << " (" << strerror(errno) << "), polling it instead" << endl;
+}
+
+FollowBuf::~FollowBuf()
+{
+    if (notify != -1)
+        close(notify);
+}
+
+// Deal with the file being truncated or replaced, returning true if there's
+// something new to read.
+bool
+FollowBuf::replaced()
+{
+    struct stat byName, byFd;
+    if (stat(path.c_str(), &byName) == -1 || fstat(fd, &byFd) == -1)
+        return false; // between rotation and the new file appearing.
+    if (byName.st_ino != byFd.st_ino || byName.st_dev != byFd.st_dev) {
+        int newFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (newFd == -1)
+            return false;
+        close(fd);
+        fd = newFd;
+        return true;
+    }
+    if (byFd.st_size < lseek(fd, 0, SEEK_CUR)) {
+        lseek(fd, 0, SEEK_SET);
+        return true;
+    }
+    return false;
+}
+
+FollowBuf::int_type
+FollowBuf::underflow()
+{
+    for (;;) {
+        int_type c = FdInputBuf::underflow();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+            return c;
+        if (replaced())
+            continue;
+        if (onIdle)
+            onIdle();
+        if (notify == -1) {
+            poll(0, 0, pollInterval);
+            continue;
+        }
+        // Events queued since the read are enough to wake us, so nothing
+        // written after it can be missed. Any event means "look again".
+        char events[4096];
+        while (read(notify, events, sizeof events) == -1 && errno == EINTR)
+            ;
+    }
+}
+
+unique_ptr<istream>
+openInput(const char *path, function<void()> onIdle)
+{
+    if (strcmp(path, "-") == 0)
+        return unique_ptr<istream>(new FdInput(STDIN_FILENO, false, move(onIdle)));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        // An empty file can't be mapped, but then there's nothing to read.
+        void *map = st.st_size ? mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : 0;
+        if (map != MAP_FAILED)
+            return unique_ptr<istream>(new MappedInput(fd, static_cast<const char *>(map), st.st_size));
+    }
+    return unique_ptr<istream>(new FdInput(fd, true, move(onIdle)));
+}
+
+// Take whatever the stream has buffered, waiting only if that's nothing.
+bool
+ValueReader::fill()
+{
+    streambuf *b = in.rdbuf();
+    if (b->sgetc() == char_traits<char>::eof()) {
+        in.setstate(ios::eofbit);
+        return false;
+    }
+    buf.resize(min(b->in_avail(), streamsize(1 << 16)));
+    buf.resize(b->sgetn(&buf[0], buf.size()));
+    pos = 0;
+    return true;
+}
+
+bool
+ValueReader::next(string &value)
+{
+    enum { Before, InContainer, InString, InScalar } state = Before;
+    size_t depth = 0;
+    bool escaped = false;
+    value.clear();
+    for (;;) {
+        if (pos == buf.size() && !fill())
+            return state != Before; // an unfinished value is still one to report.
+        const char *begin = buf.data() + pos, *p = begin, *stop = buf.data() + buf.size();
+        bool done = false;
+        while (p != stop && !done) {
+            char c;
+            switch (state) {
+                case Before:
+                    while (p != stop && charIs(*p, SpaceChar))
+                        ++p;
+                    begin = p;
+                    if (p == stop)
+                        break;
+                    c = *p++;
+                    if (c == '{' || c == '[') {
+                        depth = 1;
+                        state = InContainer;
+                    } else if (c == '"') {
+                        state = InString;
+                    } else if (charIs(c, StructuralChar)) {
+                        done = true; // a stray '}' or ',' is a (bad) value of its own.
+                    } else {
+                        state = InScalar;
+                    }
+                    break;
+                case InContainer:
+                    while (p != stop && !charIs(*p, StructuralChar | QuoteChar))
+                        ++p;
+                    if (p == stop)
+                        break;
+                    c = *p++;
+                    if (c == '"')
+                        state = InString;
+                    else if (c == '{' || c == '[')
+                        ++depth;
+                    else if ((c == '}' || c == ']') && --depth == 0)
+                        done = true;
+                    break;
+                case InString:
+                    if (escaped) {
+                        escaped = false;
+                        ++p;
+                        break;
+                    }
+                    while (p != stop && !charIs(*p, StringStopChar))
+                        ++p;
+                    if (p == stop)
+                        break;
+                    c = *p++;
+                    if (c == '\\')
+                        escaped = true;
+                    else if (c == '"' && depth)
+                        state = InContainer;
+                    else if (c == '"')
+                        done = true;
+                    break;
+                case InScalar:
+                    // A number or literal runs up to whatever can't be part of one.
+                    while (p != stop && !charIs(*p, SpaceChar | StructuralChar | QuoteChar))
+                        ++p;
+                    done = p != stop;
+                    break;
+            }
+        }
+        value.append(begin, p);
+        pos = p - buf.data();
+        if (done)
+            return true;
+    }
+}
@@ -0,0 +1,461 @@
+// Declarations shared between the parts of the jdent tool.
+#ifndef JDENT_H
+#define JDENT_H
+
+#include <json.h>
+#include <hash.h>
+#include <path.h>
+#include <pull.h>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+/*
+ * A streambuf over memory owned by someone else, so we can re-parse records
+ * we've already read without copying them.
+ */
+class MemoryBuf : public std::streambuf {
+public:
+    MemoryBuf() {}
+    MemoryBuf(const char *data, size_t len) { reset(data, len); }
+    void reset(const char *data, size_t len) {
+        char *p = const_cast<char *>(data);
+        setg(p, p, p + len);
+    }
+protected:
+    // Just enough to tell where we are, for error messages.
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override {
+        if (off != 0 || dir != std::ios_base::cur)
+            return pos_type(off_type(-1));
+        return pos_type(gptr() - eback());
+    }
+};
+
+class MemoryStream : public std::istream {
+    MemoryBuf buf;
+public:
+    MemoryStream() : std::istream(&buf) {}
+    MemoryStream(const char *data, size_t len) : std::istream(&buf) { reset(data, len); }
+    void reset(const char *data, size_t len) {
+        buf.reset(data, len);
+        clear();
+    }
+    void reset(const std::string &s) { reset(s.data(), s.size()); }
+};
+
+/*
+ * A streambuf appending to a string owned by someone else. Reusing the same
+ * string keeps its capacity, so repeated formatting doesn't reallocate.
+ */
+class StringBuf : public std::streambuf {
+    std::string &s;
+protected:
+    int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+            s += traits_type::to_char_type(c);
+        return traits_type::not_eof(c);
+    }
+    std::streamsize xsputn(const char *p, std::streamsize n) override {
+        s.append(p, n);
+        return n;
+    }
+public:
+    StringBuf(std::string &s_) : s(s_) {}
+};
+
+/*
+ * Buffers of a huge page or more are mapped directly, aligned, and backed by
+ * huge pages where we can get them, to save TLB misses on big jobs. Smaller
+ * ones come from the heap. "hugePages" must be set before any are allocated.
+ */
+enum class HugePages { Off, Transparent, HugeTLB };
+extern HugePages hugePages;
+void *allocBuffer(size_t size);
+void freeBuffer(void *p, size_t size);
+void printBufferStats(std::ostream &os);
+extern bool bufferStats; // set for printBufferStats: sample huge page use as we go.
+
+template <typename T> struct BufferAllocator {
+    typedef T value_type;
+    BufferAllocator() {}
+    template <typename U> BufferAllocator(const BufferAllocator<U> &) {}
+    T *allocate(size_t n) { return static_cast<T *>(allocBuffer(n * sizeof (T))); }
+    void deallocate(T *p, size_t n) { freeBuffer(p, n * sizeof (T)); }
+    template <typename U> bool operator == (const BufferAllocator<U> &) const { return true; }
+    template <typename U> bool operator != (const BufferAllocator<U> &) const { return false; }
+};
+
+/*
+ * Output to a file; finish() flushes and closes it, reporting any failure.
+ * persist() makes sure everything written so far is on disk.
+ */
+class OutputBuf : public std::streambuf {
+public:
+    virtual size_t bytesWritten() const = 0;
+    virtual bool persist() = 0;
+    virtual bool finish() = 0;
+};
+
+// A streambuf writing to a file descriptor through a buffer of its own.
+class FdOutputBuf : public OutputBuf {
+    int fd;
+    std::vector<char, BufferAllocator<char>> buf;
+    size_t written;
+    bool owned; // close the descriptor when finished.
+    bool drain();
+protected:
+    int_type overflow(int_type c) override;
+    int sync() override;
+public:
+    FdOutputBuf(int fd, size_t size = 1 << 16, bool owned = false);
+    ~FdOutputBuf();
+    size_t bytesWritten() const override { return written + (pptr() - pbase()); }
+    bool persist() override;
+    bool finish() override;
+};
+
+/*
+ * A streambuf writing through a shared mapping of a regular file, so output
+ * lands in the page cache without being copied by write(). The file is
+ * extended and mapped a large window at a time; finish() cuts it back to
+ * what was written.
+ */
+class MappedOutputBuf : public OutputBuf {
+    static const size_t window = 16 << 20;
+    int fd;
+    char *map;
+    off_t base; // file offset of "map".
+    size_t skip; // bytes to keep at the start of the first window.
+    bool advance();
+protected:
+    int_type overflow(int_type c) override;
+public:
+    MappedOutputBuf(int fd, size_t keep = 0);
+    ~MappedOutputBuf();
+    size_t bytesWritten() const override { return base + skip + (pptr() - pbase()); }
+    bool persist() override;
+    bool finish() override;
+};
+
+/*
+ * Open a file for output: mapped if it's a regular file, otherwise written.
+ * With "keep", we write after the first "keep" bytes of an existing file.
+ */
+OutputBuf *openOutput(const char *path, std::string &error, size_t keep = 0);
+
+/*
+ * A streambuf over a read-only mapping of a file, handed to the reader a
+ * chunk at a time so we see it advance. At each step, what's behind the
+ * cursor is dropped from both our mapping and the page cache, and what's
+ * ahead is prefetched, so however large the file, no more than "limit" bytes
+ * of it are resident on its account.
+ */
+class MappedInputBuf : public std::streambuf {
+    int fd;
+    const char *map;
+    size_t size;
+    size_t chunk;
+    size_t released; // everything before this has been dropped.
+    size_t fetched; // readahead has been requested up to here.
+    void window(size_t start);
+protected:
+    int_type underflow() override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode) override;
+public:
+    static size_t limit;
+    MappedInputBuf(int fd, const char *map, size_t size);
+    ~MappedInputBuf();
+};
+
+class MappedInput : public std::istream {
+    MappedInputBuf buf;
+public:
+    MappedInput(int fd, const char *map, size_t size)
+        : std::istream(&buf), buf(fd, map, size) {}
+};
+
+/*
+ * A streambuf reading a file descriptor with read(), so we see data as soon
+ * as it arrives rather than when a buffer fills. If its "onIdle" is set,
+ * it's called when no input has come for "idleTimeout" milliseconds, so
+ * whoever owns the output can flush it while we wait for more.
+ */
+class FdInputBuf : public std::streambuf {
+    std::vector<char> buf;
+protected:
+    int fd;
+    bool owned; // close the descriptor when done.
+    int_type underflow() override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode) override;
+public:
+    static int idleTimeout;
+    std::function<void()> onIdle;
+    FdInputBuf(int fd, bool owned, size_t size = 1 << 16);
+    ~FdInputBuf();
+};
+
+class FdInput : public std::istream {
+    FdInputBuf buf;
+public:
+    FdInput(int fd, bool owned, std::function<void()> onIdle = nullptr)
+        : std::istream(&buf), buf(fd, owned) { buf.onIdle = std::move(onIdle); }
+};
+
+/*
+ * An FdInputBuf over a named file that, at the end of the file, waits with
+ * inotify for more to be written rather than returning EOF. If the file is
+ * truncated, we start again from the beginning; if another file takes its
+ * name, as when logs are rotated, we move on to that once we've read the
+ * whole of the old one. Without inotify, as when we're out of watches, it
+ * looks again every so often instead.
+ */
+class FollowBuf : public FdInputBuf {
+    static const int pollInterval = 250; // ms between looks without inotify.
+    std::string path;
+    int notify;
+    bool replaced();
+protected:
+    int_type underflow() override;
+public:
+    FollowBuf(int fd, const std::string &path);
+    ~FollowBuf();
+};
+
+// Open a file for input: mapped if it's a regular file, otherwise read,
+// calling "onIdle" when it stalls. "-" is stdin.
+std::unique_ptr<std::istream> openInput(const char *path, std::function<void()> onIdle = nullptr);
+
+/*
+ * Splits a stream of JSON values written back to back ("{..}{..}[..]"),
+ * with or without whitespace between them, by a structural scan: it follows
+ * strings and the nesting of objects and arrays without parsing anything
+ * else, so a bad value is passed on whole for its consumer to report. It
+ * reads ahead of the values it has handed out, by up to what the stream has
+ * buffered.
+ */
+class ValueReader {
+    std::istream &in;
+    std::string buf;
+    size_t pos = 0;
+    bool fill();
+public:
+    ValueReader(std::istream &in_) : in(in_) {}
+    // Put the next value in "value", returning false at the end of the input.
+    bool next(std::string &value);
+};
+
+// With --concat, records are values back to back rather than NDJSON lines.
+extern bool concatenated;
+
+/*
+ * Call fn(line) for each non-blank line of an NDJSON stream, or each value
+ * with --concat. The line is passed by non-const reference so callers can
+ * steal its buffer.
+ */
+template <typename Fn> void
+forEachRecord(std::istream &in, Fn &&fn)
+{
+    std::string line;
+    if (concatenated) {
+        ValueReader values(in);
+        while (values.next(line))
+            fn(line);
+        return;
+    }
+    while (std::getline(in, line))
+        if (line.find_first_not_of(" \t\r") != std::string::npos)
+            fn(line);
+}
+
+// The files named on the command line ("-" or none at all means stdin.)
+typedef std::vector<const char *> Inputs;
+typedef std::function<void(std::istream &, const char *)> InputFn;
+
+// indent.cc
+bool forEachInput(const Inputs &inputs, const InputFn &fn);
+
+/*
+ * Run fn(0) .. fn(n - 1) concurrently, fn(0) on the calling thread. Once all
+ * have finished, rethrow the first exception any of them threw.
+ */
+void runThreads(unsigned n, const std::function<void(unsigned)> &fn);
+
+// Save "tracking" if we've read far enough since it was last saved.
+void checkpointDue(std::istream &in, std::ostream &out);
+
+// format.cc
+
+/*
+ * What the formatter does: "doFloat" parses numbers as floats (-f), and
+ * values at the paths in "redactions" are hidden. When checkpointing a
+ * document, "tracking" follows the formatter through it, and it calls
+ * checkpointDue() after each element.
+ */
+struct Checkpoint;
+extern bool doFloat;
+extern JSON::PathTrie redactions;
+extern Checkpoint *tracking;
+
+/*
+ * Indent one JSON document, returning a description of what's wrong with it,
+ * if anything. Without "floats", the -f option decides how to parse numbers.
+ */
+std::string indentDocument(std::istream &in, std::ostream &out);
+std::string indentDocument(std::istream &in, std::ostream &out, bool floats);
+
+// Carry on formatting a document from where "tracking" says we'd got to.
+std::string resumeDocument(std::istream &in, std::ostream &out);
+
+/*
+ * indentDocument for --batched: parseEvents hands the input to an
+ * EventFormatter in batches of events, tokenizing on a thread of its own
+ * if "threaded".
+ */
+std::string indentBatched(std::istream &in, std::ostream &out, bool threaded);
+
+/*
+ * indentBatched for an NDJSON record of "size" bytes: it's tokenized on
+ * this thread in one block, by a tokenizer kept from record to record.
+ */
+std::string indentBatchedRecord(std::istream &in, size_t size, std::ostream &out);
+
+/*
+ * Indent a document given as the events of a PullParser, rather than by
+ * parsing it ourselves, with the same result as indentDocument (short of
+ * the final newline.) event() returns false if one can't be written.
+ */
+class EventFormatter {
+    struct Level {
+        bool object;
+        size_t count;
+        const JSON::PathTrie::Node *redact;
+    };
+    std::ostream &out;
+    bool floats;
+    std::vector<Level> stack;
+    const JSON::PathTrie::Node *redact; // for the value to come.
+    size_t skipping = 0; // how deep we are in a redacted value.
+    bool finished = false;
+    std::string text; // reused for each key and string, and
+    MemoryStream number; // each number we parse with -f.
+public:
+    EventFormatter(std::ostream &out, bool floats);
+    bool event(const JSON::Event &e, JSON::ParseError &err);
+    bool done() const { return finished; }
+};
+
+// topk.cc
+bool topRecords(const Inputs &inputs, std::ostream &out, size_t k, const std::string &path);
+
+// dedup.cc
+struct DedupOptions {
+    bool canonical; // hash the canonical form of records rather than their text.
+    const char *key; // hash only the value at this path.
+    size_t memLimit; // bytes of hashes to hold in memory before spilling to disk, 0 for no limit.
+    std::string spillDir;
+    DedupOptions() : canonical(false), key(0), memLimit(0) {}
+};
+void canonicalValue(std::istream &in, std::ostream &out);
+bool dedupRecords(const Inputs &inputs, std::ostream &out, const DedupOptions &opts);
+
+// partition.cc
+struct PartitionOptions {
+    const char *path;
+    std::string outDir;
+    size_t maxOpen; // file descriptors held open across all writer threads.
+    unsigned threads;
+    PartitionOptions() : path(0), outDir("."), maxOpen(256), threads(1) {}
+};
+bool partitionRecords(const Inputs &inputs, const PartitionOptions &opts);
+
+// csv.cc
+struct CsvOptions {
+    std::vector<std::string> columns; // a path for each column.
+    char sep;
+    bool header;
+    unsigned threads;
+    CsvOptions() : sep(','), header(true), threads(1) {}
+};
+bool csvRecords(const Inputs &inputs, std::ostream &out, const CsvOptions &opts);
+
+// columnar.cc
+struct ColumnarOptions {
+    const char *file;
+    std::vector<std::string> columns; // if empty, use the leaves found in the sample.
+    size_t sampleSize; // records used to infer the schema.
+    size_t rowGroupSize;
+    unsigned threads;
+    ColumnarOptions() : file(0), sampleSize(1000), rowGroupSize(65536), threads(1) {}
+};
+bool columnarRecords(const Inputs &inputs, const ColumnarOptions &opts);
+
+// batch.cc
+struct BatchOptions {
+    const char *list; // file with one input name per line, "-" for stdin.
+    std::string suffix; // if set, write "name" + suffix for each input rather than stdout.
+    unsigned threads;
+    const class OutputCache *cache;
+    BatchOptions() : list(0), threads(1), cache(0) {}
+};
+bool indentFiles(std::ostream &out, const BatchOptions &opts);
+bool indentInPlace(const Inputs &inputs, unsigned threads);
+
+// server.cc
+bool serve(const char *path, unsigned threads);
+bool client(const char *path, const Inputs &inputs, std::ostream &out, bool floats);
+
+// cache.cc
+#define JDENT_VERSION "1.1"
+
+/*
+ * A directory of indented output, named by a hash of the input's identity
+ * (or content) and the options it was formatted with.
+ */
+class OutputCache {
+    std::string dir;
+    bool byContent;
+    std::string options;
+    bool key(const char *name, Hash128 &key) const;
+public:
+    OutputCache(const std::string &dir, bool byContent, const std::string &options);
+    /*
+     * Return a descriptor for the indented form of "name", formatting it into
+     * the cache first if need be. On failure, returns -1 and sets "error";
+     * if the error is empty, the file can't be cached and should be
+     * formatted directly.
+     */
+    int get(const char *name, std::string &error) const;
+};
+bool copyFd(int from, int to);
+bool copyFd(int from, std::ostream &to);
+
+// checkpoint.cc
+
+/*
+ * How far we've got formatting a file, so that if we're interrupted, a
+ * later run can carry on from there. "stack" holds the containers we're
+ * inside, outermost first, with how many of each one's elements we've
+ * finished; for an object, "key" names the element in progress.
+ */
+struct Checkpoint {
+    struct Level {
+        bool object;
+        size_t count;
+        std::string key;
+    };
+    std::string input;
+    std::string options;
+    size_t inputOffset = 0;
+    size_t outputOffset = 0;
+    std::vector<Level> stack;
+    bool save(const std::string &path, std::string &error) const;
+    bool load(const std::string &path, std::string &error);
+};
+
+#endif
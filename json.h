@@ -2,9 +2,13 @@
 #ifndef PME_JSON_H
 #define PME_JSON_H
 
-#include <cctype>
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <istream>
+#include <limits>
+#include <type_traits>
 #include <sstream>
 #include <iomanip>
 
@@ -13,104 +17,410 @@ namespace JSON {
 class InvalidJSON : public std::exception {
     std::string err;
 public:
-    const char *what() const throw() { return err.c_str(); }
-    InvalidJSON(const std::string &err_) throw() : err(err_) {}
-    ~InvalidJSON() throw() {};
+    const char *what() const noexcept { return err.c_str(); }
+    InvalidJSON(const std::string &err_) : err(err_) {}
 };
 
 enum Type { Array, Boolean, Null, Number, Object, String, Eof, JSONTypeCount };
 
+/*
+ * Classes of character, looked up with one load per byte rather than a
+ * locale-dependent isspace() or isdigit(), or a chain of comparisons.
+ * "startType" gives the type of a value starting with each character, or
+ * JSONTypeCount if none can. Indexing with a byte from sgetc() is safe even
+ * at EOF: -1 becomes 0xff, which is in no class.
+ */
+enum CharClass : uint8_t {
+    SpaceChar = 1, // JSON's whitespace, which is narrower than isspace's.
+    DigitChar = 2,
+    StructuralChar = 4, // {}[]:,
+    QuoteChar = 8,
+    EscapeChar = 16, // must be escaped in a string.
+    HighChar = 32, // part of a multibyte UTF-8 sequence.
+    StringStopChar = 64, // '"', '\\', or 0xff, which is also EOF truncated.
+    NumberChar = 128, // can appear in a number.
+};
+
+struct CharTable {
+    uint8_t classes[256];
+    Type startType[256];
+};
+
+constexpr CharTable
+makeCharTable()
+{
+    CharTable t {};
+    for (int c = 0; c < 256; ++c) {
+        uint8_t cls = 0;
+        Type type = JSONTypeCount;
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            cls |= SpaceChar;
+        if (c >= '0' && c <= '9') {
+            cls |= DigitChar;
+            type = Number;
+        }
+        switch (c) {
+            case '{': case '}': case '[': case ']': case ':': case ',':
+                cls |= StructuralChar;
+                break;
+            case '"':
+                cls |= QuoteChar | EscapeChar;
+                type = String;
+                break;
+            case '\\': cls |= EscapeChar; break;
+            case '-': type = Number; break;
+            case 't': case 'f': type = Boolean; break;
+            case 'n': type = Null; break;
+        }
+        if (c == '{')
+            type = Object;
+        if (c == '[')
+            type = Array;
+        if (c < 0x20)
+            cls |= EscapeChar;
+        if (c >= 0x80)
+            cls |= HighChar;
+        if (c == '"' || c == '\\' || c == 0xff)
+            cls |= StringStopChar;
+        if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E')
+            cls |= NumberChar;
+        t.classes[c] = cls;
+        t.startType[c] = type;
+    }
+    return t;
+}
+
+inline constexpr CharTable charTable = makeCharTable();
+
+static inline bool
+charIs(int c, uint8_t cls)
+{
+    return charTable.classes[uint8_t(c)] & cls;
+}
+
 static inline int
 skipSpace(std::istream &l)
 {
-    while (!l.eof() && isspace(l.peek()))
-        l.ignore();
-    return l.eof() ? -1 : l.peek();
+    std::streambuf *b = l.rdbuf();
+    int c;
+    while (charIs(c = b->sgetc(), SpaceChar))
+        b->sbumpc();
+    if (c == std::char_traits<char>::eof())
+        l.setstate(std::ios::eofbit);
+    return c;
 }
 
-static inline char
-expectAfterSpace(std::istream &l, char expected)
+/*
+ * Errors. Each parsing function below reports failure by returning false
+ * (or, for peekType, something other than a type) and describing it in a
+ * ParseError, so a caller expecting bad input, such as NDJSON with
+ * malformed records, pays nothing for unwinding. The functions that throw
+ * InvalidJSON instead are built on these, and are left out when compiling
+ * without exceptions.
+ */
+enum class Errc : uint8_t {
+    None,
+    Unexpected, // a character that can't go where it is.
+    BadNumber,
+    NotInteger,
+    OutOfRange,
+    BadString, // a bad escape or UTF-8 sequence, or the end of input.
+    BadLiteral, // true, false or null misspelt.
+    ReadFailed, // the input itself failed, rather than its content.
+};
+
+struct ParseError {
+    Errc code = Errc::None;
+    std::streamoff offset = -1; // in the input, where the stream can tell us.
+    std::string detail;
+    explicit operator bool() const { return code != Errc::None; }
+    std::string message() const {
+        return offset < 0 ? detail : detail + " at offset " + std::to_string(offset);
+    }
+};
+
+static inline bool
+parseFailed(std::istream &l, ParseError &err, Errc code, std::string detail)
+{
+    err.code = code;
+    err.detail = std::move(detail);
+    err.offset = l.rdbuf()->pubseekoff(0, std::ios::cur, std::ios::in);
+    return false;
+}
+
+static inline bool
+expectAfterSpace(std::istream &l, char expected, ParseError &err)
 {
     char c = skipSpace(l);
     if (c != expected)
-        throw InvalidJSON(std::string("expected '") + expected + "', got '" + c + "'");
-    l.ignore();
-    return c;
+        return parseFailed(l, err, Errc::Unexpected,
+                std::string("expected '") + expected + "', got '" + c + "'");
+    l.rdbuf()->sbumpc();
+    return true;
 }
 
-static inline void
-skipText(std::istream &l, const char *text)
+/*
+ * Match the four characters of "text" with one load and compare, rather
+ * than one at a time; sgetn deals with them straddling the end of the
+ * stream's buffer.
+ */
+static inline bool
+matchWord(std::streambuf *b, const char (&text)[5])
 {
-    for (size_t i = 0; text[i]; ++i) {
-        char c;
-        l.get(c);
-        if (c != text[i])
-            throw InvalidJSON(std::string("expected '") + text +  "'");
-    }
+    uint32_t got, want;
+    std::memcpy(&want, text, sizeof want);
+    return b->sgetn(reinterpret_cast<char *>(&got), sizeof got) == sizeof got && got == want;
 }
 
+// Returns Eof at the end of input, and JSONTypeCount if no value starts here.
 static inline Type
-peekType(std::istream &l)
+peekType(std::istream &l, ParseError &err)
 {
-    char c = skipSpace(l);
-    switch (c) {
-        case '{': return Object;
-        case '[': return Array;
-        case '"': return String;
-        case '-': return Number;
-        case 't' : case 'f': return Boolean;
-        case 'n' : return Null;
-        case -1: return Eof;
-        default: {
-            if (c >= '0' && c <= '9')
-                return Number;
-            throw InvalidJSON(std::string("unexpected token '") + char(c) + "' at start of JSON object");
+    int c = skipSpace(l);
+    if (c == std::char_traits<char>::eof())
+        return Eof;
+    Type type = charTable.startType[uint8_t(c)];
+    if (type == JSONTypeCount)
+        parseFailed(l, err, Errc::Unexpected,
+                std::string("unexpected token '") + char(c) + "' at start of JSON object");
+    return type;
+}
+
+/*
+ * The text of a number. Where it lies within the stream's buffer, it's
+ * read in one go rather than a character at a time. Numbers too long for
+ * "buf", which no int64_t is, spill into "big".
+ */
+struct NumberText {
+    char buf[32];
+    size_t len = 0;
+    std::string big;
+    const char *data() const { return big.empty() ? buf : big.data(); }
+    size_t size() const { return big.empty() ? len : big.size(); }
+    std::string str() const { return std::string(data(), size()); }
+};
+
+static inline void
+readNumber(std::istream &l, NumberText &text)
+{
+    std::streambuf *b = l.rdbuf();
+    skipSpace(l);
+    text.len = 0;
+    text.big.clear();
+    std::streamsize avail = std::min(b->in_avail(), std::streamsize(sizeof text.buf));
+    if (avail > 0) {
+        std::streamsize got = b->sgetn(text.buf, avail);
+        std::streamsize n = 0;
+        while (n < got && charIs(text.buf[n], NumberChar))
+            ++n;
+        if (n < got) {
+            // The number ends within what we took; give back the rest.
+            for (std::streamsize i = n; i < got; ++i)
+                b->sungetc();
+            text.len = n;
+            return;
         }
+        text.big.assign(text.buf, got);
     }
+    // The number runs past the end of the buffer.
+    int c;
+    while (charIs(c = b->sgetc(), NumberChar))
+        text.big += char(b->sbumpc());
+    if (c == std::char_traits<char>::eof())
+        l.setstate(std::ios::eofbit);
 }
 
-template <typename Context> void parseObject(std::istream &l, Context &&ctx);
-template <typename Context> void parseArray(std::istream &l, Context &&ctx);
+// Whether "p" spells a number the way JSON does.
+static inline bool
+validNumber(const char *p, size_t n)
+{
+    const char *e = p + n;
+    auto digits = [&p, e] () -> bool {
+        if (p == e || !charIs(*p, DigitChar))
+            return false;
+        while (p != e && charIs(*p, DigitChar))
+            ++p;
+        return true;
+    };
+    if (p != e && *p == '-')
+        ++p;
+    if (p != e && *p == '0')
+        ++p;
+    else if (!digits())
+        return false;
+    if (p != e && *p == '.' && (++p, !digits()))
+        return false;
+    if (p != e && (*p == 'e' || *p == 'E')) {
+        ++p;
+        if (p != e && (*p == '+' || *p == '-'))
+            ++p;
+        if (!digits())
+            return false;
+    }
+    return p == e;
+}
 
-template <typename I> I
-parseInt(std::istream &l)
+/*
+ * Convert up to eight digits at once, with three multiplies in place of a
+ * loop: each step combines adjacent pairs of the previous step's numbers.
+ * See Lemire, "Faster integer parsing".
+ */
+static inline uint64_t
+parseEightDigits(const char *p, size_t n)
 {
-    int sign;
-    char c;
-    if (skipSpace(l) == '-') {
-        sign = -1;
-        l.ignore();
-    } else {
-        sign = 1;
+    char digits[8] = { '0', '0', '0', '0', '0', '0', '0', '0' };
+    std::memcpy(digits + 8 - n, p, n); // right-aligned, after leading zeros.
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t v;
+    std::memcpy(&v, digits, sizeof v);
+    v -= 0x3030303030303030;
+    v = v * 10 + (v >> 8);
+    return ((v & 0x000000ff000000ff) * (100 + (1000000ULL << 32))
+            + ((v >> 16) & 0x000000ff000000ff) * (1 + (10000ULL << 32))) >> 32;
+#else
+    uint64_t v = 0;
+    for (char c : digits)
+        v = v * 10 + c - '0';
+    return v;
+#endif
+}
+
+/*
+ * The value of a run of digits, if it fits in a uint64_t. Any 19 digits
+ * do, so only a twentieth needs checking for overflow.
+ */
+static inline bool
+digitsValue(const char *p, size_t n, uint64_t &value)
+{
+    if (n == 0 || n > 20 || (n > 1 && *p == '0'))
+        return false;
+    for (size_t i = 0; i < n; ++i)
+        if (!charIs(p[i], DigitChar))
+            return false;
+    size_t whole = std::min(n, size_t(19));
+    size_t first = whole % 8 ? whole % 8 : 8;
+    const char *end = p + whole;
+    uint64_t v = parseEightDigits(p, first);
+    for (p += first; p != end; p += 8)
+        v = v * 100000000 + parseEightDigits(p, 8);
+    if (n == 20) {
+        unsigned last = *p - '0';
+        if (v > (std::numeric_limits<uint64_t>::max() - last) / 10)
+            return false;
+        v = v * 10 + last;
     }
-    I rv = 0;
-    if (l.peek() == '0') {
-        l.ignore(); // leading zero.
-    } else if (isdigit(l.peek())) {
-        while (isdigit(c = l.peek())) {
-            rv = rv * 10 + c - '0';
-            l.ignore();
+    value = v;
+    return true;
+}
+
+/*
+ * The value of the text of a number, if it's an integer that fits in an
+ * int64_t. The digits of the largest ones fit in a uint64_t, so we can check
+ * the range after converting them.
+ */
+static inline bool
+integerValue(const char *p, size_t n, int64_t &value)
+{
+    bool negative = n != 0 && *p == '-';
+    uint64_t v;
+    if (!digitsValue(p + negative, n - negative, v))
+        return false;
+    uint64_t limit = uint64_t(std::numeric_limits<int64_t>::max()) + negative;
+    if (v > limit)
+        return false;
+    value = negative ? int64_t(0 - v) : int64_t(v);
+    return true;
+}
+
+// The same for a uint64_t, where "-0" is the only negative allowed.
+static inline bool
+unsignedValue(const char *p, size_t n, uint64_t &value)
+{
+    bool negative = n != 0 && *p == '-';
+    return digitsValue(p + negative, n - negative, value) && (!negative || value == 0);
+}
+
+static inline bool
+parseNumberText(std::istream &l, NumberText &text, ParseError &err)
+{
+    readNumber(l, text);
+    if (!validNumber(text.data(), text.size()))
+        return parseFailed(l, err, Errc::BadNumber, "invalid number '" + text.str() + "'");
+    return true;
+}
+
+/*
+ * Integral types are parsed exactly, failing if the value is out of their
+ * range. Floating types accumulate digits, for parseFloat.
+ */
+template <typename I> bool
+parseInt(std::istream &l, I &value, ParseError &err)
+{
+    if constexpr (std::is_integral<I>::value) {
+        NumberText text;
+        readNumber(l, text);
+        bool inRange;
+        if constexpr (std::is_signed<I>::value) {
+            int64_t v;
+            inRange = integerValue(text.data(), text.size(), v)
+                && v >= int64_t(std::numeric_limits<I>::min()) && v <= int64_t(std::numeric_limits<I>::max());
+            if (inRange)
+                value = I(v);
+        } else {
+            uint64_t v;
+            inRange = unsignedValue(text.data(), text.size(), v) && v <= uint64_t(std::numeric_limits<I>::max());
+            if (inRange)
+                value = I(v);
         }
+        if (!inRange) {
+            if (!validNumber(text.data(), text.size()))
+                return parseFailed(l, err, Errc::BadNumber, "invalid number '" + text.str() + "'");
+            if (text.str().find_first_of(".eE") != std::string::npos)
+                return parseFailed(l, err, Errc::NotInteger, "expected an integer '" + text.str() + "'");
+            return parseFailed(l, err, Errc::OutOfRange, "integer out of range '" + text.str() + "'");
+        }
+        return true;
     } else {
-        throw InvalidJSON("expected digit");
+        int sign;
+        char c;
+        if (skipSpace(l) == '-') {
+            sign = -1;
+            l.ignore();
+        } else {
+            sign = 1;
+        }
+        I rv = 0;
+        if (l.peek() == '0') {
+            l.ignore(); // leading zero.
+        } else if (charIs(l.peek(), DigitChar)) {
+            while (charIs(c = l.peek(), DigitChar)) {
+                rv = rv * 10 + c - '0';
+                l.ignore();
+            }
+        } else {
+            return parseFailed(l, err, Errc::BadNumber, "expected digit");
+        }
+        value = rv * sign;
+        return true;
     }
-    return rv * sign;
 }
 
 /*
  * Note that you can use parseInt instead when you know the value will be
  * integral.
  */
-
-template <typename FloatType> static inline FloatType
-parseFloat(std::istream &l)
+template <typename FloatType> static inline bool
+parseFloat(std::istream &l, FloatType &value, ParseError &err)
 {
-    FloatType rv = parseInt<FloatType>(l);
+    bool negative = skipSpace(l) == '-'; // so "-0.5" keeps its sign.
+    FloatType rv;
+    if (!parseInt<FloatType>(l, rv, err))
+        return false;
     if (l.peek() == '.') {
         l.ignore();
-        FloatType scale = rv < 0 ? -1 : 1;
+        FloatType scale = negative ? -1 : 1;
         char c;
-        while (isdigit(c = l.peek())) {
+        while (charIs(c = l.peek(), DigitChar)) {
             l.ignore();
             scale /= 10;
             rv = rv + scale * (c - '0');
@@ -124,22 +434,26 @@ parseFloat(std::istream &l)
             sign = c == '+' ? 1 : -1;
             l.ignore();
             c = l.peek();
-        } else if (isdigit(c)) {
+        } else if (charIs(c, DigitChar)) {
             sign = 1;
         } else {
-            throw InvalidJSON("expected sign or numeric after exponent");
+            return parseFailed(l, err, Errc::BadNumber, "expected sign or numeric after exponent");
+        }
+        // Exponents may have leading zeros, unlike integers.
+        int exponent = 0;
+        if (!charIs(l.peek(), DigitChar))
+            return parseFailed(l, err, Errc::BadNumber, "expected digit in exponent");
+        while (charIs(c = l.peek(), DigitChar)) {
+            exponent = std::min(exponent * 10 + c - '0', 100000);
+            l.ignore();
         }
-        auto exponent = sign * parseInt<int>(l);
-        rv *= std::pow(10.0, exponent);
+        rv *= std::pow(10.0, sign * exponent);
     }
-    return rv;
+    value = rv;
+    return true;
 }
 
-template <typename Integer> inline Integer parseNumber(std::istream &i) { return parseInt<long double>(i); }
-template <> inline double parseNumber<double> (std::istream &i) { return parseFloat<double>(i); }
-template <> inline float parseNumber<float> (std::istream &i) { return parseFloat<float>(i); }
-template <> inline long double parseNumber<long double> (std::istream &i) { return parseFloat<long double>(i); }
-
+// The value of a hex digit, or -1 if it isn't one.
 static inline int hexval(char c)
 {
     if (c >= '0' && c <= '9')
@@ -148,7 +462,7 @@ static inline int hexval(char c)
         return c - 'A' + 10;
     if (c >= 'a' && c <= 'f')
         return c - 'a' + 10;
-    throw InvalidJSON(std::string("not a hex char: " + c));
+    return -1;
 }
 
 struct UTF8 {
@@ -179,142 +493,221 @@ operator<<(std::ostream &os, const UTF8 &utf)
     return os;
 }
 
-static std::string
-parseString(std::istream &l)
+/*
+ * Append what an escape sequence stands for to "rv", taking the characters
+ * after the backslash from next(). If it's bad, "what" says why.
+ */
+template <typename Next> static inline bool
+unescape(Next &&next, std::string &rv, std::string &what)
+{
+    int c;
+    switch (c = next()) {
+        case '"':
+        case '\\':
+        case '/':
+            rv += char(c);
+            return true;
+        case 'b':
+            rv += '\b';
+            return true;
+        case 'f':
+            rv += '\f';
+            return true;
+        case 'n':
+            rv += '\n';
+            return true;
+        case 'r':
+            rv += '\r';
+            return true;
+        case 't':
+            rv += '\t';
+            return true;
+        case 'u': {
+            // get unicode char.
+            int codePoint = 0;
+            for (size_t i = 0; i < 4; ++i) {
+                char h = char(next());
+                int digit = hexval(h);
+                if (digit < 0) {
+                    what = std::string("not a hex char: ") + h;
+                    return false;
+                }
+                codePoint = codePoint * 16 + digit;
+            }
+            std::ostringstream utf8;
+            utf8 << UTF8(codePoint);
+            rv += utf8.str();
+            return true;
+        }
+        default:
+            what = std::string("invalid quoted char '") + char(c) + "'";
+            return false;
+    }
+}
+
+static bool
+parseString(std::istream &l, std::string &rv, ParseError &err)
 {
-    expectAfterSpace(l, '"');
-    std::ostringstream rv;
+    if (!expectAfterSpace(l, '"', err))
+        return false;
+    std::streambuf *b = l.rdbuf();
+    rv.clear();
     for (;;) {
-        char c;
-        l.get(c);
+        int c = b->sbumpc();
+        if (!charIs(c, StringStopChar)) {
+            rv += char(c);
+            continue;
+        }
         switch (c) {
             case '"':
-                return rv.str();
-            case '\\':
-                l.get(c);
-                switch (c) {
-                    case '"':
-                    case '\\':
-                    case '/':
-                        rv << c;
-                        break;
-                    case 'b':
-                        rv << '\b';
-                        break;
-                    case 'f':
-                        rv << '\f';
-                        break;
-                    case 'n':
-                        rv << '\n';
-                        break;
-                    case 'r':
-                        rv << '\r';
-                        break;
-                    case 't':
-                        rv << '\t';
-                        break;
-                    default:
-                        throw InvalidJSON(std::string("invalid quoted char '") + c + "'");
-                    case 'u': {
-                        // get unicode char.
-                        int codePoint = 0;
-                        for (size_t i = 0; i < 4; ++i) {
-                            l.get(c);
-                            codePoint = codePoint * 16 + hexval(c);
-                        }
-                        rv << UTF8(codePoint);
-                    }
-                    break;
-                }
+                return true;
+            case '\\': {
+                std::string what;
+                if (!unescape([b] { return b->sbumpc(); }, rv, what))
+                    return parseFailed(l, err, Errc::BadString, what);
                 break;
-            default:
-                rv << c;
+            }
+            case 0xff:
+                rv += char(c);
                 break;
+            default:
+                l.setstate(std::ios::eofbit | std::ios::failbit);
+                return parseFailed(l, err, Errc::BadString, "unterminated string");
         }
     }
 }
 
 static inline bool
-parseBoolean(std::istream &l)
+parseBoolean(std::istream &l, bool &value, ParseError &err)
 {
-    char c = skipSpace(l);
-    switch (c) {
-        case 't': skipText(l, "true"); return true;
-        case 'f': skipText(l, "false"); return false;
-        default: throw InvalidJSON("expected 'true' or 'false'");
+    std::streambuf *b = l.rdbuf();
+    switch (skipSpace(l)) {
+        case 't':
+            if (!matchWord(b, "true"))
+                return parseFailed(l, err, Errc::BadLiteral, "expected 'true'");
+            value = true;
+            return true;
+        case 'f':
+            b->sbumpc();
+            if (!matchWord(b, "alse"))
+                return parseFailed(l, err, Errc::BadLiteral, "expected 'false'");
+            value = false;
+            return true;
+        default:
+            return parseFailed(l, err, Errc::BadLiteral, "expected 'true' or 'false'");
     }
 }
 
-static inline void
-parseNull(std::istream &l)
+static inline bool
+parseNull(std::istream &l, ParseError &err)
 {
     skipSpace(l);
-    skipText(l, "null");
-}
-
-static inline void // Parse any value but discard the result.
-parseValue(std::istream &l)
-{
-    switch (peekType(l)) {
-        case Array: parseArray(l, parseValue); break;
-        case Boolean: parseBoolean(l); break;
-        case Null: parseNull(l); break;
-        case Number: parseNumber<float>(l); break;
-        case Object: parseObject(l, [](std::istream &l, std::string) -> void { parseValue(l); }); break;
-        case String: parseString(l); break;
-        default: throw InvalidJSON("unknown type for JSON construct");
-    }
+    if (!matchWord(l.rdbuf(), "null"))
+        return parseFailed(l, err, Errc::BadLiteral, "expected 'null'");
+    return true;
 }
 
-template <typename Context> void
-parseObject(std::istream &l, Context &&ctx)
+/*
+ * Containers call ctx(l, key) for each member of an object, or ctx(l) for
+ * each element of an array, which must consume the value and return true,
+ * or fill in "err" and return false to stop the parse.
+ *
+ * continueObject and continueArray take up parsing a container from just
+ * after one of its elements, so a caller can resume part way through one.
+ */
+template <typename Context> bool
+continueObject(std::istream &l, Context &&ctx, ParseError &err)
 {
-    expectAfterSpace(l, '{');
+    std::string fieldName;
     for (;;) {
-        std::string fieldName;
         char c;
         switch (c = skipSpace(l)) {
             case '"': // Name of next field.
-                fieldName = parseString(l);
-                expectAfterSpace(l, ':');
-                ctx(l, fieldName);
+                if (!parseString(l, fieldName, err) || !expectAfterSpace(l, ':', err)
+                        || !ctx(l, fieldName))
+                    return false;
                 break;
             case '}': // End of this object
                 l.ignore();
-                return;
+                return true;
             case ',': // Separator to next field
                 l.ignore();
                 break;
-            default: {
-                throw InvalidJSON(std::string("unexpected character '") + char(c) + "' parsing object");
-            }
+            default:
+                return parseFailed(l, err, Errc::Unexpected,
+                        std::string("unexpected character '") + char(c) + "' parsing object");
         }
     }
 }
 
-template <typename Context> void
-parseArray(std::istream &l, Context &&ctx)
+template <typename Context> bool
+parseObject(std::istream &l, Context &&ctx, ParseError &err)
 {
-    expectAfterSpace(l, '[');
-    char c;
-    if ((c = skipSpace(l)) == ']') {
-        l.ignore();
-        return; // empty array
-    }
-    for (size_t i = 0;; i++) {
-        skipSpace(l);
-        ctx(l);
-        c = skipSpace(l);
+    return expectAfterSpace(l, '{', err) && continueObject(l, ctx, err);
+}
+
+template <typename Context> bool
+continueArray(std::istream &l, Context &&ctx, ParseError &err)
+{
+    for (;;) {
+        char c = skipSpace(l);
         switch (c) {
             case ']':
                 l.ignore();
-                return;
+                return true;
             case ',':
                 l.ignore();
                 break;
             default:
-                throw InvalidJSON(std::string("expected ']' or ',', got '") + c + "'");
+                return parseFailed(l, err, Errc::Unexpected,
+                        std::string("expected ']' or ',', got '") + c + "'");
+        }
+        skipSpace(l);
+        if (!ctx(l))
+            return false;
+    }
+}
+
+template <typename Context> bool
+parseArray(std::istream &l, Context &&ctx, ParseError &err)
+{
+    if (!expectAfterSpace(l, '[', err))
+        return false;
+    if (skipSpace(l) == ']') {
+        l.ignore();
+        return true; // empty array
+    }
+    return ctx(l) && continueArray(l, ctx, err);
+}
+
+static inline bool // Parse any value but discard the result.
+parseValue(std::istream &l, ParseError &err)
+{
+    switch (peekType(l, err)) {
+        case Array:
+            return parseArray(l, [&err] (std::istream &l) -> bool { return parseValue(l, err); }, err);
+        case Boolean: {
+            bool value;
+            return parseBoolean(l, value, err);
+        }
+        case Null:
+            return parseNull(l, err);
+        case Number: {
+            NumberText text;
+            return parseNumberText(l, text, err);
         }
+        case Object:
+            return parseObject(l, [&err] (std::istream &l, const std::string &) -> bool {
+                return parseValue(l, err);
+            }, err);
+        case String: {
+            std::string value;
+            return parseString(l, value, err);
+        }
+        case Eof:
+            return parseFailed(l, err, Errc::Unexpected, "unknown type for JSON construct");
+        default:
+            return false; // peekType said why.
     }
 }
 
@@ -323,10 +716,22 @@ struct Escape {
     Escape(std::string value_) : value(value_) { }
 };
 
-inline std::ostream & operator << (std::ostream &o, const Escape &escape)
+/*
+ * Write a string with JSON's escapes, returning false if it isn't valid
+ * UTF-8, in which case some of it may have been written.
+ */
+static inline bool
+writeEscaped(std::ostream &o, const std::string &value)
 {
     auto flags(o.flags());
-    for (auto i = escape.value.begin(); i != escape.value.end();) {
+    for (auto i = value.begin(); i != value.end();) {
+        // Write out the run of characters that can go as they are.
+        auto run = i;
+        while (run != value.end() && !charIs(*run, EscapeChar | HighChar))
+            ++run;
+        o.write(&*i, run - i);
+        if ((i = run) == value.end())
+            break;
         int c;
         switch (c = (unsigned char)*i++) {
             case '\b': o << "\\b"; break;
@@ -338,21 +743,25 @@ inline std::ostream & operator << (std::ostream &o, const Escape &escape)
             case '\t': o << "\\t"; break;
             default:
                 if (unsigned(c) < 32) {
-                    o << "\\u" << std::hex << unsigned(c);
+                    o << "\\u" << std::hex << std::setfill('0') << std::setw(4) << unsigned(c);
                 } else if (c & 0x80) {
                     // multibyte UTF-8: build up the unicode codepoint.
                     unsigned long v = c;
                     int count = 0;
                     for (int mask = 0x80; mask & v; mask >>= 1) {
-                        if (mask == 0)
-                            throw InvalidJSON("malformed UTF-8 string");
                         count++;
                         v &= ~mask;
                     }
+                    if (value.end() - i < count - 1) {
+                        o.flags(flags);
+                        return false;
+                    }
                     while (--count) {
                         c = (unsigned char)*i++;
-                        if ((c & 0xc0) != 0x80)
-                            throw InvalidJSON("illegal character in multibyte sequence");
+                        if ((c & 0xc0) != 0x80) {
+                            o.flags(flags);
+                            return false;
+                        }
                         v = (v << 6) | (c & 0x3f);
                     }
                     o << "\\u" << std::hex << std::setfill('0') << std::setw(4) << v;
@@ -363,16 +772,167 @@ inline std::ostream & operator << (std::ostream &o, const Escape &escape)
         }
     }
     o.flags(flags);
+    return true;
+}
+
+inline std::ostream & operator << (std::ostream &o, const Escape &escape)
+{
+    if (!writeEscaped(o, escape.value)) {
+#if __cpp_exceptions
+        throw InvalidJSON("illegal character in multibyte sequence");
+#else
+        o.setstate(std::ios::failbit);
+#endif
+    }
     return o;
 }
 
+#if __cpp_exceptions
+/*
+ * The throwing API. Each of these throws InvalidJSON where its counterpart
+ * above would return false, and the callbacks given to the containers
+ * return nothing.
+ */
+[[noreturn]] static inline void
+throwError(const ParseError &err)
+{
+    throw InvalidJSON(err.message());
+}
+
+static inline char
+expectAfterSpace(std::istream &l, char expected)
+{
+    ParseError err;
+    if (!expectAfterSpace(l, expected, err))
+        throwError(err);
+    return expected;
+}
+
+static inline Type
+peekType(std::istream &l)
+{
+    ParseError err;
+    Type type = peekType(l, err);
+    if (err)
+        throwError(err);
+    return type;
+}
+
+template <typename I> I
+parseInt(std::istream &l)
+{
+    ParseError err;
+    I value = 0;
+    if (!parseInt<I>(l, value, err))
+        throwError(err);
+    return value;
+}
+
+template <typename FloatType> static inline FloatType
+parseFloat(std::istream &l)
+{
+    ParseError err;
+    FloatType value = 0;
+    if (!parseFloat<FloatType>(l, value, err))
+        throwError(err);
+    return value;
+}
+
+/*
+ * Return the text of a number exactly as it was written, for when we want to
+ * pass it through rather than interpret it.
+ */
+static inline std::string
+parseNumberText(std::istream &l)
+{
+    ParseError err;
+    NumberText text;
+    if (!parseNumberText(l, text, err))
+        throwError(err);
+    return text.str();
+}
+
+template <typename Integer> inline Integer parseNumber(std::istream &i) { return parseInt<Integer>(i); }
+template <> inline double parseNumber<double> (std::istream &i) { return parseFloat<double>(i); }
+template <> inline float parseNumber<float> (std::istream &i) { return parseFloat<float>(i); }
+template <> inline long double parseNumber<long double> (std::istream &i) { return parseFloat<long double>(i); }
+
+static inline std::string
+parseString(std::istream &l)
+{
+    ParseError err;
+    std::string value;
+    if (!parseString(l, value, err))
+        throwError(err);
+    return value;
+}
+
+static inline bool
+parseBoolean(std::istream &l)
+{
+    ParseError err;
+    bool value = false;
+    if (!parseBoolean(l, value, err))
+        throwError(err);
+    return value;
+}
+
+static inline void
+parseNull(std::istream &l)
+{
+    ParseError err;
+    if (!parseNull(l, err))
+        throwError(err);
+}
+
+static inline void // Parse any value but discard the result.
+parseValue(std::istream &l)
+{
+    ParseError err;
+    if (!parseValue(l, err))
+        throwError(err);
+}
+
+template <typename Context> void
+continueObject(std::istream &l, Context &&ctx)
+{
+    ParseError err;
+    if (!continueObject(l, [&ctx] (std::istream &l, std::string &key) -> bool { ctx(l, key); return true; }, err))
+        throwError(err);
+}
+
+template <typename Context> void
+parseObject(std::istream &l, Context &&ctx)
+{
+    ParseError err;
+    if (!parseObject(l, [&ctx] (std::istream &l, std::string &key) -> bool { ctx(l, key); return true; }, err))
+        throwError(err);
+}
+
+template <typename Context> void
+continueArray(std::istream &l, Context &&ctx)
+{
+    ParseError err;
+    if (!continueArray(l, [&ctx] (std::istream &l) -> bool { ctx(l); return true; }, err))
+        throwError(err);
+}
+
+template <typename Context> void
+parseArray(std::istream &l, Context &&ctx)
+{
+    ParseError err;
+    if (!parseArray(l, [&ctx] (std::istream &l) -> bool { ctx(l); return true; }, err))
+        throwError(err);
+}
+
 template <typename Parsee> void parse(std::istream &is, Parsee &);
-template <> void parse<int>(std::istream &is, int &parsee) { parsee = parseInt<int>(is); }
-template <> void parse<long>(std::istream &is, long &parsee) { parsee = parseInt<long>(is); }
-template <> void parse<float>(std::istream &is, float &parsee) { parsee = parseFloat<float>(is); }
-template <> void parse<double>(std::istream &is, double &parsee) { parsee = parseFloat<double>(is); }
-template <> void parse<std::string>(std::istream &is, std::string &parsee) { parsee = parseString(is); }
-template <> void parse<bool>(std::istream &is, bool &parsee) { parsee = parseBoolean(is); }
+template <> inline void parse<int>(std::istream &is, int &parsee) { parsee = parseInt<int>(is); }
+template <> inline void parse<long>(std::istream &is, long &parsee) { parsee = parseInt<long>(is); }
+template <> inline void parse<float>(std::istream &is, float &parsee) { parsee = parseFloat<float>(is); }
+template <> inline void parse<double>(std::istream &is, double &parsee) { parsee = parseFloat<double>(is); }
+template <> inline void parse<std::string>(std::istream &is, std::string &parsee) { parsee = parseString(is); }
+template <> inline void parse<bool>(std::istream &is, bool &parsee) { parsee = parseBoolean(is); }
+#endif
 
 
 }
@@ -386,7 +946,12 @@ operator<<(std::ostream &os, const JSON::Type &t)
         case JSON::Number: os << "Number"; break;
         case JSON::Object: os << "Object"; break;
         case JSON::String: os << "String"; break;
-        default: throw JSON::InvalidJSON("not a JSON type");
+        default:
+#if __cpp_exceptions
+            throw JSON::InvalidJSON("not a JSON type");
+#else
+            os.setstate(std::ios::failbit);
+#endif
     }
     return os;
 }
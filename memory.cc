@@ -0,0 +1,99 @@
+// Large buffers, backed by huge pages where the system will give us them.
+#include <jdent.h>
+#include <atomic>
+#include <fstream>
+#include <new>
+#include <sys/mman.h>
+
+using namespace std;
+
+HugePages hugePages = HugePages::Transparent;
+bool bufferStats;
+
+namespace {
+
+static const size_t hugePageSize = 2 << 20;
+
+struct Stats {
+    atomic<size_t> mapped, bytes, hugetlb, advised;
+    atomic<size_t> anonHuge, fileHuge; // peaks, in kB.
+};
+static Stats stats;
+
+// Huge pages are only faulted in as a buffer's used, so we look at how many
+// the process has while buffers are live, before they're freed.
+static void
+sampleHugePages()
+{
+    ifstream rollup("/proc/self/smaps_rollup");
+    rollup.ignore(256, '\n'); // the address range covered.
+    string key;
+    size_t kb;
+    while (rollup >> key >> kb) {
+        atomic<size_t> *peak = key == "AnonHugePages:" ? &stats.anonHuge
+            : key == "FilePmdMapped:" ? &stats.fileHuge : 0;
+        if (peak)
+            for (size_t old = *peak; kb > old && !peak->compare_exchange_weak(old, kb);)
+                ;
+        rollup.ignore(256, '\n');
+    }
+}
+
+}
+
+void *
+allocBuffer(size_t size)
+{
+    if (hugePages == HugePages::Off || size < hugePageSize)
+        return ::operator new(size);
+    size_t len = (size + hugePageSize - 1) & ~(hugePageSize - 1);
+    ++stats.mapped;
+    stats.bytes += len;
+    if (hugePages == HugePages::HugeTLB) {
+        void *p = mmap(0, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            ++stats.hugetlb;
+            return p;
+        }
+        // The pool is empty or not configured; transparent ones may do.
+    }
+
+    // Over-allocate so we can trim the mapping to a huge page boundary,
+    // which THP needs to back it with whole huge pages.
+    char *p = static_cast<char *>(mmap(0, len + hugePageSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (p == MAP_FAILED)
+        throw bad_alloc();
+    size_t lead = (hugePageSize - reinterpret_cast<uintptr_t>(p) % hugePageSize) % hugePageSize;
+    if (lead)
+        munmap(p, lead);
+    munmap(p + lead + len, hugePageSize - lead);
+    p += lead;
+    if (madvise(p, len, MADV_HUGEPAGE) == 0)
+        ++stats.advised;
+    return p;
+}
+
+void
+freeBuffer(void *p, size_t size)
+{
+    if (hugePages == HugePages::Off || size < hugePageSize) {
+        ::operator delete(p);
+        return;
+    }
+    if (bufferStats)
+        sampleHugePages();
+    munmap(p, (size + hugePageSize - 1) & ~(hugePageSize - 1));
+}
+
+void
+printBufferStats(ostream &os)
+{
+    sampleHugePages();
+    os << "large buffers: " << stats.mapped << " (" << (stats.bytes >> 20) << " MiB), "
+       << stats.hugetlb << " from the hugetlb pool, "
+       << stats.advised << " advised for transparent huge pages" << endl
+       << "huge pages: peak AnonHugePages " << stats.anonHuge << " kB, FilePmdMapped "
+       << stats.fileHuge << " kB" << endl;
+}
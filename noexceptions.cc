@@ -0,0 +1,43 @@
+// A driver for the formatter built with -fno-exceptions, run by "make check".
+#include <jdent.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+static bool good = true;
+
+// jdent's, in indent.cc; the formatter only calls it while "tracking" is set.
+void
+checkpointDue(istream &, ostream &)
+{
+}
+
+// Format "text" both ways, expecting "want", or an error if "ok" is false.
+static void
+expectFormat(const string &text, bool ok, const string &want = string())
+{
+    for (bool batched : { false, true }) {
+        istringstream in(text);
+        ostringstream out;
+        string error = batched ? indentBatched(in, out, false) : indentDocument(in, out, false);
+        if (error.empty() != ok || (ok && out.str() != want)) {
+            cerr << (batched ? "indentBatched(" : "indentDocument(") << text << "): "
+                 << (error.empty() ? "got " + out.str() : error) << endl;
+            good = false;
+        }
+    }
+}
+
+int
+main()
+{
+    expectFormat("{\"a\":[1,2.5,\"x\"],\"b\":{}}", true,
+            "{\n    \"a\": [\n        1,\n        2.5,\n        \"x\"\n    ],\n    \"b\": {}\n}\n");
+    expectFormat("\"\\u00e9\\n\"", true, "\"\\u00e9\\n\"\n");
+    expectFormat("[1,", false);
+    expectFormat("{\"a\":tru}", false);
+    expectFormat("18446744073709551616", true, "18446744073709551616\n");
+    return good ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+// Output streams written straight to file descriptors.
+#include <jdent.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+FdOutputBuf::FdOutputBuf(int fd_, size_t size, bool owned_)
+    : fd(fd_), buf(size), owned(owned_)
+{
+    // Count from wherever the descriptor is, so we know where our output ends.
+    off_t at = lseek(fd, 0, SEEK_CUR);
+    written = at == -1 ? 0 : at;
+    setp(&buf[0], &buf[0] + buf.size());
+}
+
+FdOutputBuf::~FdOutputBuf()
+{
+    if (fd != -1)
+        finish();
+}
+
+bool
+FdOutputBuf::finish()
+{
+    bool ok = drain();
+    if (owned && close(fd) == -1)
+        ok = false;
+    fd = -1;
+    return ok;
+}
+
+bool
+FdOutputBuf::persist()
+{
+    return drain() && fdatasync(fd) == 0;
+}
+
+bool
+FdOutputBuf::drain()
+{
+    for (char *p = pbase(); p < pptr();) {
+        ssize_t rc = write(fd, p, pptr() - p);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return false;
+        p += rc;
+        written += rc;
+    }
+    setp(&buf[0], &buf[0] + buf.size());
+    return true;
+}
+
+FdOutputBuf::int_type
+FdOutputBuf::overflow(int_type c)
+{
+    if (!drain())
+        return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+        sputc(traits_type::to_char_type(c));
+    return traits_type::not_eof(c);
+}
+
+int
+FdOutputBuf::sync()
+{
+    return drain() ? 0 : -1;
+}
+
+MappedOutputBuf::MappedOutputBuf(int fd_, size_t keep)
+    : fd(fd_), map(0)
+{
+    // Mappings start on a page boundary.
+    base = keep - keep % sysconf(_SC_PAGESIZE);
+    skip = keep - base;
+    setp(0, 0); // the first write maps the first window.
+}
+
+MappedOutputBuf::~MappedOutputBuf()
+{
+    if (fd != -1)
+        finish();
+}
+
+/*
+ * Move on to the next window of the file. Space for it is allocated up
+ * front where the filesystem allows, so running out of space shows up here
+ * as an error rather than as a SIGBUS when we store to the mapping.
+ */
+bool
+MappedOutputBuf::advance()
+{
+    if (map) {
+        munmap(map, window);
+        map = 0;
+        base += window;
+    }
+    setp(0, 0);
+    if (fallocate(fd, 0, base, window) == -1
+            && (errno != EOPNOTSUPP || ftruncate(fd, base + window) == -1))
+        return false;
+    void *p = mmap(0, window, PROT_READ | PROT_WRITE, MAP_SHARED, fd, base);
+    if (p == MAP_FAILED)
+        return false;
+    map = static_cast<char *>(p);
+    setp(map, map + window);
+    pbump(skip);
+    skip = 0;
+    return true;
+}
+
+MappedOutputBuf::int_type
+MappedOutputBuf::overflow(int_type c)
+{
+    if (!advance())
+        return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+        sputc(traits_type::to_char_type(c));
+    return traits_type::not_eof(c);
+}
+
+bool
+MappedOutputBuf::persist()
+{
+    return (!map || msync(map, pptr() - map, MS_SYNC) == 0) && fdatasync(fd) == 0;
+}
+
+bool
+MappedOutputBuf::finish()
+{
+    off_t size = bytesWritten();
+    if (map)
+        munmap(map, window);
+    map = 0;
+    setp(0, 0);
+    bool ok = ftruncate(fd, size) == 0;
+    if (close(fd) == -1)
+        ok = false;
+    fd = -1;
+    return ok;
+}
+
+OutputBuf *
+openOutput(const char *path, string &error, size_t keep)
+{
+    int flags = O_CREAT | O_CLOEXEC | (keep ? 0 : O_TRUNC);
+    int fd = open(path, O_RDWR | flags, 0666);
+    if (fd == -1)
+        fd = open(path, O_WRONLY | flags, 0666);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        error = string("failed to open ") + path + ": " + strerror(errno);
+        if (fd != -1)
+            close(fd);
+        return 0;
+    }
+    if (keep) {
+        // Drop anything written after what we're keeping.
+        if (!S_ISREG(st.st_mode) || size_t(st.st_size) < keep
+                || ftruncate(fd, keep) == -1 || lseek(fd, keep, SEEK_SET) == -1) {
+            error = string(path) + " doesn't have the output we're continuing";
+            close(fd);
+            return 0;
+        }
+    }
+    if (S_ISREG(st.st_mode) && (fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDWR)
+        return new MappedOutputBuf(fd, keep);
+    return new FdOutputBuf(fd, 2 << 20, true);
+}
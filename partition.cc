@@ -0,0 +1,253 @@
+// Split an NDJSON stream into one file per value of a field.
+#include <jdent.h>
+#include <hash.h>
+#include <path.h>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <iostream>
+#include <list>
+#include <sstream>
+#include <system_error>
+#include <unistd.h>
+#include <unordered_map>
+
+using namespace JSON;
+using namespace std;
+
+namespace {
+
+/*
+ * The partitions owned by one writer thread. Records are buffered per
+ * partition; at most "maxOpen" files are held open at once, the least
+ * recently written being closed to make room.
+ */
+class PartitionSet {
+    struct Partition {
+        string path;
+        string buf;
+        int fd;
+        bool created; // we've truncated the file in this run.
+        list<Partition *>::iterator lru;
+        Partition() : fd(-1), created(false) {}
+    };
+    static const size_t flushSize = 1 << 16;
+    string dir;
+    size_t maxOpen;
+    unordered_map<string, Partition> partitions;
+    list<Partition *> open; // most recently written first.
+
+    void write(Partition &p);
+    void drain(Partition &p);
+public:
+    PartitionSet(const string &dir_, size_t maxOpen_) : dir(dir_), maxOpen(maxOpen_ ? maxOpen_ : 1) {}
+    ~PartitionSet();
+    void append(const string &name, const string &record);
+    void flush();
+};
+
+void
+PartitionSet::write(Partition &p)
+{
+    if (p.fd == -1) {
+        if (open.size() >= maxOpen) {
+            Partition *victim = open.back();
+            open.pop_back();
+            drain(*victim);
+            close(victim->fd);
+            victim->fd = -1;
+            // It may not be written again for a while; don't hold its buffer.
+            string().swap(victim->buf);
+        }
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (p.created ? O_APPEND : O_TRUNC);
+        p.fd = ::open(p.path.c_str(), flags, 0666);
+        if (p.fd == -1)
+            throw system_error(errno, generic_category(), "opening " + p.path);
+        p.created = true;
+        open.push_front(&p);
+    } else if (p.lru != open.begin()) {
+        open.splice(open.begin(), open, p.lru);
+    }
+    p.lru = open.begin();
+    drain(p);
+}
+
+// Write out what's buffered for an open partition.
+void
+PartitionSet::drain(Partition &p)
+{
+    for (size_t off = 0; off < p.buf.size();) {
+        ssize_t rc = ::write(p.fd, p.buf.data() + off, p.buf.size() - off);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            throw system_error(errno, generic_category(), "writing " + p.path);
+        }
+        off += rc;
+    }
+    p.buf.clear();
+}
+
+void
+PartitionSet::append(const string &name, const string &record)
+{
+    Partition &p = partitions[name];
+    if (p.path.empty())
+        p.path = dir + "/" + name;
+    p.buf += record;
+    p.buf += '\n';
+    if (p.buf.size() >= flushSize)
+        write(p);
+}
+
+void
+PartitionSet::flush()
+{
+    for (auto &p : partitions)
+        if (!p.second.buf.empty())
+            write(p.second);
+}
+
+PartitionSet::~PartitionSet()
+{
+    for (auto p : open)
+        close(p->fd);
+}
+
+/*
+ * Make a field's value into a file name that stays inside the output
+ * directory. Names starting with one "_" are kept for ones a value can't
+ * have, so a value starting with "_" gets another. A name too long for the
+ * filesystem is cut short and ends in a hash of the whole value instead,
+ * making it one byte longer than any name that wasn't cut, so the two kinds
+ * can't collide.
+ */
+static string
+fileName(const string &value)
+{
+    static const string suffix = ".ndjson";
+    static const size_t maxName = NAME_MAX - suffix.size() - 1;
+    string rv;
+    for (char c : value)
+        rv += c == '/' || c == '\0' ? '_' : c;
+    if (rv.empty() || rv == "." || rv == ".." || rv[0] == '_')
+        rv = "_" + rv;
+    if (rv.size() > maxName) {
+        string hash = "~" + hash128(value).hex();
+        size_t cut = maxName + 1 - hash.size();
+        while (cut && (rv[cut] & 0xc0) == 0x80)
+            --cut; // not in the middle of a UTF-8 character.
+        rv.resize(cut);
+        rv.resize(maxName + 1 - hash.size(), '~');
+        rv += hash;
+    }
+    return rv + suffix;
+}
+
+// Where records without the field go; no value's fileName() is the same.
+static const char missingName[] = "_missing.ndjson";
+
+/*
+ * A batch of records, and the partition each is destined for. Threads find
+ * partition names for disjoint slices of the batch; then each writer thread
+ * scans the whole batch for records in the partitions it owns, so no
+ * partition is ever touched by two threads and nothing needs locking.
+ */
+struct Batch {
+    static const size_t maxRecords = 1 << 14;
+    vector<string> records;
+    vector<string> names;
+    vector<size_t> owners;
+    vector<string> errors;
+    vector<unsigned long> lines;
+    size_t count;
+    Batch() : records(maxRecords), names(maxRecords), owners(maxRecords),
+        errors(maxRecords), lines(maxRecords), count(0) {}
+};
+
+static void
+nameRecords(Batch &batch, size_t begin, size_t end, const PathTrie &trie, size_t writers)
+{
+    MemoryStream record;
+    ostringstream value;
+    hash<string> hasher;
+    for (size_t i = begin; i < end; ++i) {
+        string &name = batch.names[i];
+        batch.errors[i].clear();
+        name.clear();
+        bool found = false;
+        record.reset(batch.records[i]);
+        try {
+            walkPaths(record, trie.root, [&] (istream &l, int) -> void {
+                found = true;
+                if (peekType(l) == String) {
+                    name = parseString(l);
+                } else {
+                    value.str("");
+                    canonicalValue(l, value);
+                    name = value.str();
+                }
+            });
+        }
+        catch (const InvalidJSON &je) {
+            batch.errors[i] = je.what();
+            continue;
+        }
+        name = found ? fileName(name) : missingName;
+        batch.owners[i] = hasher(name) % writers;
+    }
+}
+
+}
+
+bool
+partitionRecords(const Inputs &inputs, const PartitionOptions &opts)
+{
+    PathTrie trie;
+    trie.add(opts.path);
+    unsigned threads = opts.threads ? opts.threads : 1;
+    vector<unique_ptr<PartitionSet>> writers;
+    for (unsigned i = 0; i < threads; ++i)
+        writers.emplace_back(new PartitionSet(opts.outDir, max(opts.maxOpen / threads, size_t(1))));
+    Batch batch;
+    bool good = true;
+    const char *currentName = "";
+
+    auto drain = [&] () -> void {
+        runThreads(threads, [&] (unsigned t) -> void {
+            nameRecords(batch, batch.count * t / threads, batch.count * (t + 1) / threads, trie, threads);
+        });
+        for (size_t i = 0; i < batch.count; ++i) {
+            if (!batch.errors[i].empty()) {
+                cerr << currentName << ":" << batch.lines[i] << ": invalid JSON: " << batch.errors[i] << endl;
+                good = false;
+            }
+        }
+        runThreads(threads, [&] (unsigned t) -> void {
+            for (size_t i = 0; i < batch.count; ++i)
+                if (batch.errors[i].empty() && batch.owners[i] == t)
+                    writers[t]->append(batch.names[i], batch.records[i]);
+        });
+        batch.count = 0;
+    };
+
+    try {
+        good = forEachInput(inputs, [&] (istream &in, const char *name) -> void {
+            unsigned long lineno = 0;
+            currentName = name;
+            forEachRecord(in, [&] (string &line) -> void {
+                batch.lines[batch.count] = ++lineno;
+                batch.records[batch.count++].swap(line);
+                if (batch.count == Batch::maxRecords)
+                    drain();
+            });
+            drain();
+        }) && good;
+        runThreads(threads, [&] (unsigned t) -> void { writers[t]->flush(); });
+    }
+    catch (const system_error &ex) {
+        cerr << "partition: " << ex.what() << endl;
+        good = false;
+    }
+    return good;
+}
@@ -0,0 +1,185 @@
+// Paths into JSON values, and a trie to match a set of them in one pass.
+#ifndef PME_JSON_PATH_H
+#define PME_JSON_PATH_H
+
+#include <json.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace JSON {
+
+// A component of a path: an object key or array index, or a wildcard.
+struct PathKey {
+    std::string key;
+    bool wildcard = false;
+};
+
+/*
+ * A path is a list of object keys or array indexes separated by '.', eg
+ * "request.headers.0". A backslash quotes the following character, so keys
+ * containing dots can still be named. The empty path is the value itself.
+ * A component of "*" is a wildcard (see PathTrie), while "\*" is a key of "*".
+ */
+static inline std::vector<PathKey>
+splitPath(const std::string &path)
+{
+    std::vector<PathKey> rv;
+    if (path.empty())
+        return rv;
+    rv.emplace_back();
+    bool quoted = false;
+    auto finish = [&] () -> void {
+        rv.back().wildcard = rv.back().key == "*" && !quoted;
+        quoted = false;
+    };
+    for (size_t i = 0; i < path.size(); ++i) {
+        char c = path[i];
+        if (c == '\\' && i + 1 < path.size()) {
+            rv.back().key += path[++i];
+            quoted = true;
+        } else if (c == '.') {
+            finish();
+            rv.emplace_back();
+        } else {
+            rv.back().key += c;
+        }
+    }
+    finish();
+    return rv;
+}
+
+/*
+ * Whether two paths can match the same value, or one a value inside the
+ * other's. walkPaths only reports one of such a pair, the shorter.
+ */
+static inline bool
+pathsOverlap(const std::vector<PathKey> &a, const std::vector<PathKey> &b)
+{
+    for (size_t i = 0; i < a.size() && i < b.size(); ++i)
+        if (!a[i].wildcard && !b[i].wildcard && a[i].key != b[i].key)
+            return false;
+    return true;
+}
+
+/*
+ * A set of paths, arranged so we can follow all of them at once while
+ * parsing. A "*" component is a wildcard that matches any key or index;
+ * exact children are kept as supersets of their wildcard sibling, so looking
+ * up a single child is enough to find every path that can match.
+ */
+class PathTrie {
+public:
+    struct Node {
+        std::map<std::string, std::unique_ptr<Node>> children;
+        std::unique_ptr<Node> wildcard;
+        int leaf; // index of the path ending at this node, or -1.
+        Node() : leaf(-1) {}
+        const Node *child(const std::string &key) const {
+            auto it = children.find(key);
+            return it != children.end() ? it->second.get() : wildcard.get();
+        }
+    };
+
+    Node root;
+    size_t size() const { return ids.size(); }
+
+    // Add a path to the trie, returning the index "walkPaths" reports it with.
+    int add(const std::string &path) {
+        auto it = ids.find(path);
+        if (it != ids.end())
+            return it->second;
+        int id = int(ids.size());
+        ids[path] = id;
+        insert(&root, splitPath(path), 0, id);
+        return id;
+    }
+
+private:
+    std::map<std::string, int> ids;
+
+    static void merge(Node *to, const Node &from) {
+        if (to->leaf == -1)
+            to->leaf = from.leaf;
+        for (auto &child : from.children) {
+            auto &dst = to->children[child.first];
+            if (!dst)
+                dst.reset(new Node());
+            merge(dst.get(), *child.second);
+        }
+        if (from.wildcard) {
+            if (!to->wildcard)
+                to->wildcard.reset(new Node());
+            merge(to->wildcard.get(), *from.wildcard);
+        }
+    }
+
+    static void insert(Node *node, const std::vector<PathKey> &keys, size_t i, int id) {
+        if (i == keys.size()) {
+            if (node->leaf == -1)
+                node->leaf = id;
+            return;
+        }
+        if (keys[i].wildcard) {
+            if (!node->wildcard)
+                node->wildcard.reset(new Node());
+            insert(node->wildcard.get(), keys, i + 1, id);
+            for (auto &child : node->children)
+                insert(child.second.get(), keys, i + 1, id);
+        } else {
+            auto &child = node->children[keys[i].key];
+            if (!child) {
+                child.reset(new Node());
+                if (node->wildcard)
+                    merge(child.get(), *node->wildcard);
+            }
+            insert(child.get(), keys, i + 1, id);
+        }
+    }
+};
+
+#if __cpp_exceptions
+/*
+ * Parse a value, calling found(stream, index) for each path in the trie that
+ * matches part of it. "found" must consume the matched value. Anything not on
+ * a path in the trie is skipped without being handed to the caller. If one
+ * path is a prefix of another, the shorter one wins.
+ */
+template <typename Found> void
+walkPaths(std::istream &l, const PathTrie::Node &node, Found &&found)
+{
+    if (node.leaf != -1) {
+        found(l, node.leaf);
+        return;
+    }
+    switch (peekType(l)) {
+        case Object:
+            parseObject(l, [&node, &found] (std::istream &l, std::string key) -> void {
+                const PathTrie::Node *child = node.child(key);
+                if (child)
+                    walkPaths(l, *child, found);
+                else
+                    parseValue(l);
+            });
+            break;
+        case Array: {
+            size_t idx = 0;
+            parseArray(l, [&node, &found, &idx] (std::istream &l) -> void {
+                const PathTrie::Node *child = node.child(std::to_string(idx++));
+                if (child)
+                    walkPaths(l, *child, found);
+                else
+                    parseValue(l);
+            });
+            break;
+        }
+        default:
+            parseValue(l);
+            break;
+    }
+}
+#endif
+
+}
+#endif
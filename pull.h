@@ -0,0 +1,324 @@
+// A pull parser: JSON in a buffer as a sequence of events.
+#ifndef PME_JSON_PULL_H
+#define PME_JSON_PULL_H
+
+#include <json.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace JSON {
+
+enum class EventType : uint8_t {
+    BeginObject, EndObject, BeginArray, EndArray, Key, String, Number, Boolean, Null
+};
+
+struct Event {
+    EventType type;
+    // A key or string, unescaped; a number, "true", "false" or "null" as written.
+    std::string_view text;
+    size_t offset; // where the event starts in the buffer.
+};
+
+/*
+ * Where parseObject and parseArray push values at callbacks, a PullParser
+ * hands them over an event at a time when asked, so its user can stop
+ * early, skip what it doesn't want, or put the parse aside and come back to
+ * it. It reads a buffer rather than a stream, so an event's text points into
+ * the buffer, except for strings with escapes, which are unescaped into the
+ * parser's own storage and last until the next event. A range-for over the
+ * parser runs through the events of one value; afterwards, failed() says
+ * whether that was because of an error.
+ *
+ * If the buffer isn't "complete", more input may follow it: running out
+ * part way through an event isn't an error, but makes next() return false
+ * with starved() set, leaving the parser where it was before the call. Once
+ * there's more, refill() carries on with a buffer starting where this one
+ * left off.
+ *
+ *     PullParser parser(record);
+ *     for (const Event &event : parser)
+ *         if (event.type == EventType::Key && event.text == "big")
+ *             parser.skip();
+ */
+class PullParser {
+    enum State : uint8_t { Value, ObjectFirst, ObjectNext, ArrayFirst, ArrayNext, Done };
+    const char *start, *p, *stop;
+    size_t base = 0; // where "start" is in the whole input.
+    bool complete;
+    bool hungry = false;
+    const char *mark; // where next() started, and in what state.
+    State markState;
+    State state = Value;
+    EventType last = EventType::Null;
+    std::vector<bool> stack; // the containers we're in; true for objects.
+    std::string scratch;
+    ParseError err;
+
+    bool fail(Errc code, std::string detail) {
+        err.code = code;
+        err.detail = std::move(detail);
+        err.offset = offset();
+        state = Done;
+        return false;
+    }
+    bool starve() {
+        p = mark;
+        state = markState;
+        hungry = true;
+        return false;
+    }
+    bool starving() const { return p == stop && !complete; }
+    int peek() const { return p != stop ? (unsigned char)*p : std::char_traits<char>::eof(); }
+    void skipSpace() {
+        while (p != stop && charIs(*p, SpaceChar))
+            ++p;
+    }
+    void afterValue() { state = stack.empty() ? Done : stack.back() ? ObjectNext : ArrayNext; }
+    bool readString(Event &event);
+    bool readValue(Event &event);
+
+public:
+    explicit PullParser(std::string_view text, bool complete_ = true)
+        : start(text.data()), p(text.data()), stop(text.data() + text.size()), complete(complete_) {}
+
+    // Start again on a new value, keeping the storage we've grown.
+    void reset(std::string_view text, bool complete_ = true) {
+        start = p = text.data();
+        stop = start + text.size();
+        base = 0;
+        complete = complete_;
+        hungry = false;
+        state = Value;
+        last = EventType::Null;
+        stack.clear();
+        err = ParseError();
+    }
+
+    // Carry on with a buffer starting with what's left of this one, from used().
+    void refill(std::string_view text, bool complete_) {
+        base += p - start;
+        start = p = text.data();
+        stop = start + text.size();
+        complete = complete_;
+    }
+
+    /*
+     * Move on to the next event, returning false when the value is complete
+     * (or the buffer held only whitespace), or if it's invalid.
+     */
+    bool next(Event &event);
+
+    /*
+     * Skip the rest of the value the last event started: a whole object or
+     * array after its Begin event, or a member's value after its Key. This
+     * needs a complete buffer.
+     */
+    bool skip();
+
+    bool failed() const { return bool(err); }
+    bool starved() const { return hungry; }
+    const ParseError &error() const { return err; }
+    size_t used() const { return p - start; } // how much of the buffer we're done with.
+    size_t offset() const { return base + used(); } // how far we've read in the whole input.
+    size_t depth() const { return stack.size(); }
+
+    class iterator {
+        PullParser *parser;
+        Event event;
+    public:
+        iterator() : parser(nullptr) {}
+        explicit iterator(PullParser *parser_) : parser(parser_) { ++*this; }
+        const Event &operator*() const { return event; }
+        const Event *operator->() const { return &event; }
+        iterator &operator++() {
+            if (!parser->next(event))
+                parser = nullptr;
+            return *this;
+        }
+        bool operator==(const iterator &other) const { return parser == other.parser; }
+        bool operator!=(const iterator &other) const { return parser != other.parser; }
+    };
+    iterator begin() { return iterator(this); }
+    iterator end() { return iterator(); }
+};
+
+inline bool
+PullParser::readString(Event &event)
+{
+    const char *text = ++p;
+    // The usual case: no escapes, so the text is in the buffer as it stands.
+    while (p != stop && (!charIs(*p, StringStopChar) || (unsigned char)*p == 0xff))
+        ++p;
+    if (p != stop && *p == '"') {
+        event.text = std::string_view(text, p++ - text);
+        return true;
+    }
+    scratch.assign(text, p);
+    for (;;) {
+        int c = peek();
+        if (c == std::char_traits<char>::eof())
+            return starving() ? starve() : fail(Errc::BadString, "unterminated string");
+        ++p;
+        if (c == '"')
+            break;
+        if (c != '\\') {
+            scratch += char(c);
+            continue;
+        }
+        std::string what;
+        if (!unescape([this] { return p != stop ? (unsigned char)*p++ : std::char_traits<char>::eof(); },
+                    scratch, what))
+            return starving() ? starve() : fail(Errc::BadString, what);
+    }
+    event.text = scratch;
+    return true;
+}
+
+inline bool
+PullParser::readValue(Event &event)
+{
+    static const char *const words[] = { "null", "true", "false" };
+    int c = peek();
+    const char *word;
+    switch (c) {
+        case '{':
+        case '[':
+            ++p;
+            stack.push_back(c == '{');
+            event.type = c == '{' ? EventType::BeginObject : EventType::BeginArray;
+            event.text = std::string_view();
+            state = c == '{' ? ObjectFirst : ArrayFirst;
+            return true;
+        case '"':
+            if (!readString(event))
+                return false;
+            event.type = EventType::String;
+            break;
+        case 'n':
+        case 't':
+        case 'f':
+            word = words[c == 'n' ? 0 : c == 't' ? 1 : 2];
+            if (size_t(stop - p) < strlen(word) && !complete && std::memcmp(p, word, stop - p) == 0)
+                return starve();
+            if (size_t(stop - p) < strlen(word) || std::memcmp(p, word, strlen(word)) != 0)
+                return fail(Errc::BadLiteral, std::string("expected '") + word + "'");
+            event.type = c == 'n' ? EventType::Null : EventType::Boolean;
+            event.text = std::string_view(p, strlen(word));
+            p += strlen(word);
+            break;
+        default: {
+            if (c != '-' && !charIs(c, DigitChar)) {
+                if (c == std::char_traits<char>::eof())
+                    return stack.empty() ? (state = Done, false)
+                        : fail(Errc::Unexpected, "unexpected end of input");
+                return fail(Errc::Unexpected,
+                        std::string("unexpected token '") + char(c) + "' at start of JSON object");
+            }
+            const char *number = p;
+            while (p != stop && charIs(*p, NumberChar))
+                ++p;
+            if (starving())
+                return starve();
+            if (!validNumber(number, p - number))
+                return fail(Errc::BadNumber, "invalid number '" + std::string(number, p) + "'");
+            event.type = EventType::Number;
+            event.text = std::string_view(number, p - number);
+            break;
+        }
+    }
+    afterValue();
+    return true;
+}
+
+inline bool
+PullParser::next(Event &event)
+{
+    mark = p;
+    markState = state;
+    hungry = false;
+    for (;;) {
+        skipSpace();
+        event.offset = offset();
+        int c = peek();
+        if (state != Done && starving())
+            return starve();
+        switch (state) {
+            case Done:
+                return false;
+            case Value:
+                if (!readValue(event))
+                    return false;
+                last = event.type;
+                return true;
+            case ObjectFirst:
+            case ObjectNext:
+                if (c == '}') {
+                    ++p;
+                    stack.pop_back();
+                    event.type = last = EventType::EndObject;
+                    event.text = std::string_view();
+                    afterValue();
+                    return true;
+                }
+                if (state == ObjectNext) {
+                    if (c != ',')
+                        return fail(Errc::Unexpected,
+                                std::string("unexpected character '") + char(c) + "' parsing object");
+                    ++p;
+                    skipSpace();
+                    event.offset = offset();
+                    c = peek();
+                    if (starving())
+                        return starve();
+                }
+                if (c != '"')
+                    return fail(Errc::Unexpected, std::string("expected '\"', got '") + char(c) + "'");
+                if (!readString(event))
+                    return false;
+                skipSpace();
+                if (starving())
+                    return starve();
+                if (peek() != ':')
+                    return fail(Errc::Unexpected, std::string("expected ':', got '") + char(peek()) + "'");
+                ++p;
+                event.type = last = EventType::Key;
+                state = Value;
+                return true;
+            case ArrayFirst:
+            case ArrayNext:
+                if (c == ']') {
+                    ++p;
+                    stack.pop_back();
+                    event.type = last = EventType::EndArray;
+                    event.text = std::string_view();
+                    afterValue();
+                    return true;
+                }
+                if (state == ArrayNext) {
+                    if (c != ',')
+                        return fail(Errc::Unexpected, std::string("expected ']' or ',', got '") + char(c) + "'");
+                    ++p;
+                }
+                state = Value;
+                break;
+        }
+    }
+}
+
+inline bool
+PullParser::skip()
+{
+    Event event;
+    if (last == EventType::Key && !next(event))
+        return false;
+    if (last != EventType::BeginObject && last != EventType::BeginArray)
+        return true;
+    for (size_t depth = stack.size() - 1; stack.size() > depth;)
+        if (!next(event))
+            return false;
+    return true;
+}
+
+}
+#endif
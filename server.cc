@@ -0,0 +1,486 @@
+// Indent documents for clients connecting over a Unix domain socket.
+#include <jdent.h>
+#include <async.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace JSON;
+using namespace std;
+
+/*
+ * Protocol. Integers are in host byte order, as both ends share a machine.
+ * A connection carries any number of requests, each answered in turn:
+ *
+ *   request     u32 flags, u32 length, then the document
+ *   reply       u32 status, u32 length, then the indented document for
+ *               status 0, or an error message otherwise
+ *
+ * After a ReplyFailed, which means the server itself failed on the request,
+ * the server closes the connection.
+ */
+namespace {
+
+enum RequestFlags : uint32_t { ParseFloats = 1 };
+enum ReplyStatus : uint32_t { ReplyOK = 0, ReplyInvalid = 1, ReplyTooBig = 2, ReplyFailed = 3 };
+static const uint32_t maxRequest = 1U << 30;
+
+static bool
+readFully(int fd, void *p, size_t len)
+{
+    for (char *c = static_cast<char *>(p); len != 0;) {
+        ssize_t rc = read(fd, c, len);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return false;
+        c += rc;
+        len -= rc;
+    }
+    return true;
+}
+
+// Put the part of a message after its first "skip" bytes in "rest", returning its length.
+static int
+unsent(const struct iovec (&iov)[2], size_t skip, struct iovec (&rest)[2])
+{
+    int n = 0;
+    for (auto &v : iov) {
+        if (skip >= v.iov_len) {
+            skip -= v.iov_len;
+            continue;
+        }
+        rest[n].iov_base = static_cast<char *>(v.iov_base) + skip;
+        rest[n++].iov_len = v.iov_len - skip;
+        skip = 0;
+    }
+    return n;
+}
+
+static bool
+writeMessage(int fd, uint32_t word, const string &body)
+{
+    uint32_t header[2] = { word, uint32_t(body.size()) };
+    struct iovec iov[2] = {
+        { header, sizeof header },
+        { const_cast<char *>(body.data()), body.size() }
+    };
+    size_t skip = 0, total = sizeof header + body.size();
+    while (skip < total) {
+        struct iovec rest[2];
+        ssize_t rc = writev(fd, rest, unsent(iov, skip, rest));
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return false;
+        skip += rc;
+    }
+    return true;
+}
+
+/*
+ * A client connection. It has no thread of its own: an event loop hands it
+ * input as it arrives, and a coroutine per request (format()) parses and
+ * formats the document as it comes in, rather than once it's all here. So
+ * one thread can serve any number of connections, each holding on to its
+ * formatted output but not its input. The parser and output buffer are
+ * kept from one request to the next. While a reply is being written, any
+ * further requests wait in "stash".
+ */
+class Connection {
+    int fd;
+    int epoll;
+    uint32_t watching = EPOLLIN;
+    char header[8];
+    size_t headerSize = 0;
+    bool reading = false; // a request's payload, rather than a header.
+    uint32_t flags = 0;
+    uint32_t remaining = 0; // of the payload.
+    string start; // the first bytes of a payload, until we know if they're a BOM.
+    bool checkBom = false;
+    AsyncParser parser;
+    Task task; // format(), for the request we're reading.
+    bool done = false; // format() has finished with the request.
+    string output;
+    StringBuf outBuf;
+    ostream out;
+    string error;
+    bool replying = false;
+    uint32_t replyHeader[2];
+    size_t sent = 0; // of the header and body together.
+    string stash;
+
+    Task format();
+    bool advance();
+    void fail(exception_ptr error);
+    void watch(uint32_t events);
+    bool consume(const char *p, size_t n);
+    void payload(const char *p, size_t n);
+    void endRequest();
+    bool flush();
+public:
+    Connection(int fd_, int epoll_) : fd(fd_), epoll(epoll_), outBuf(output), out(&outBuf) {
+        out.exceptions(ios::badbit); // so running out of memory for output isn't just a short reply.
+    }
+    ~Connection() { close(fd); }
+    bool ready(); // false when we're done with the connection.
+};
+
+Task
+Connection::format()
+{
+    AsyncParser &p = parser;
+    EventFormatter formatter(out, flags & ParseFloats);
+    Event event;
+    ParseError err;
+    while (co_await p.next(event)) {
+        if (!formatter.event(event, err)) {
+            error = err.message();
+            done = true;
+            co_return;
+        }
+    }
+    if (p.pull().failed())
+        error = p.pull().error().message();
+    else
+        out << "\n";
+    done = true;
+}
+
+void
+Connection::watch(uint32_t events)
+{
+    if (events == watching)
+        return;
+    struct epoll_event ev = {};
+    ev.events = watching = events;
+    ev.data.ptr = this;
+    epoll_ctl(epoll, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/*
+ * Anything that goes wrong in serving a request, such as running out of
+ * memory for a big one, fails just this connection: whether it happens
+ * here or in format(), we tell the client and close it.
+ */
+bool
+Connection::ready()
+{
+    try {
+        if (advance())
+            return true;
+    }
+    catch (...) {
+        fail(current_exception());
+    }
+    return false;
+}
+
+void
+Connection::fail(exception_ptr error)
+{
+    string what = "internal error";
+    try {
+        rethrow_exception(error);
+    }
+    catch (const exception &e) {
+        what = e.what();
+    }
+    catch (...) {
+    }
+    writeMessage(fd, ReplyFailed, what);
+}
+
+bool
+Connection::advance()
+{
+    if (!flush())
+        return false;
+    if (replying)
+        return true; // still writing.
+    if (!stash.empty()) {
+        string input;
+        input.swap(stash);
+        if (!consume(input.data(), input.size()))
+            return false;
+        if (replying)
+            return true;
+    }
+    char buf[1 << 16];
+    ssize_t rc = read(fd, buf, sizeof buf);
+    if (rc == -1)
+        return errno == EINTR || errno == EAGAIN;
+    return rc != 0 && consume(buf, rc);
+}
+
+bool
+Connection::consume(const char *p, size_t n)
+{
+    while (n != 0) {
+        if (replying) {
+            stash.append(p, n);
+            return true;
+        }
+        if (!reading) {
+            size_t take = min(n, sizeof header - headerSize);
+            memcpy(header + headerSize, p, take);
+            headerSize += take;
+            p += take;
+            n -= take;
+            if (headerSize < sizeof header)
+                return true;
+            headerSize = 0;
+            uint32_t words[2];
+            memcpy(words, header, sizeof words);
+            if (words[1] > maxRequest) {
+                writeMessage(fd, ReplyTooBig, "request too large");
+                return false;
+            }
+            reading = true;
+            flags = words[0];
+            remaining = words[1];
+            start.clear();
+            checkBom = true;
+            done = false;
+            error.clear();
+            output.clear();
+            out.clear();
+            parser.reset();
+            task = format();
+        } else {
+            size_t take = min(n, size_t(remaining));
+            payload(p, take);
+            p += take;
+            n -= take;
+            remaining -= take;
+        }
+        if (remaining == 0)
+            endRequest();
+        if (task.error()) {
+            fail(task.error());
+            return false;
+        }
+        if (remaining == 0 && !flush())
+            return false;
+    }
+    return true;
+}
+
+void
+Connection::payload(const char *p, size_t n)
+{
+    static const char bom[] = { '\xef', '\xbb', '\xbf' };
+    if (checkBom) {
+        size_t take = min(n, sizeof bom - start.size());
+        start.append(p, take);
+        p += take;
+        n -= take;
+        if (start[0] == bom[0] && start.size() < sizeof bom)
+            return;
+        checkBom = false;
+        if (start[0] != bom[0]) {
+            parser.feed(start);
+        } else if (start.compare(0, string::npos, bom, sizeof bom) != 0) {
+            error = "invalid BOM/JSON";
+            done = true;
+        }
+    }
+    if (!done)
+        parser.feed(string_view(p, n));
+}
+
+void
+Connection::endRequest()
+{
+    if (checkBom && !start.empty()) {
+        // A payload too short to tell: indentDocument calls this an invalid BOM.
+        error = "invalid BOM/JSON";
+        done = true;
+    }
+    if (!done)
+        parser.finish();
+    reading = false;
+    replyHeader[0] = error.empty() ? ReplyOK : ReplyInvalid;
+    replyHeader[1] = uint32_t((error.empty() ? output : error).size());
+    replying = true;
+    sent = 0;
+}
+
+bool
+Connection::flush()
+{
+    if (!replying)
+        return true;
+    // The header and body go out together, without copying one after the other.
+    const string &body = error.empty() ? output : error;
+    struct iovec iov[2] = {
+        { replyHeader, sizeof replyHeader },
+        { const_cast<char *>(body.data()), body.size() }
+    };
+    while (sent < sizeof replyHeader + body.size()) {
+        struct iovec rest[2];
+        ssize_t rc = writev(fd, rest, unsent(iov, sent, rest));
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc == -1 && errno == EAGAIN) {
+            watch(EPOLLOUT);
+            return true;
+        }
+        if (rc <= 0)
+            return false;
+        sent += rc;
+    }
+    replying = false;
+    watch(EPOLLIN);
+    return true;
+}
+
+/*
+ * Serve connections as they become ready. Every loop watches the listening
+ * socket, and whichever gets to a new connection first keeps it.
+ */
+static void
+eventLoop(int listener)
+{
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = nullptr;
+    if (epoll == -1 || epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &ev) == -1) {
+        clog << "epoll: " << strerror(errno) << endl;
+        return;
+    }
+    struct epoll_event events[64];
+    for (;;) {
+        int count = epoll_wait(epoll, events, 64, -1);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count == -1) {
+            clog << "epoll_wait: " << strerror(errno) << endl;
+            break;
+        }
+        for (int i = 0; i < count; ++i) {
+            Connection *c = static_cast<Connection *>(events[i].data.ptr);
+            if (c) {
+                if (!c->ready())
+                    delete c; // closing the descriptor takes it out of epoll.
+                continue;
+            }
+            int fd = accept4(listener, 0, 0, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd == -1) {
+                if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+                    clog << "accept: " << strerror(errno) << endl;
+                continue;
+            }
+            c = new Connection(fd, epoll);
+            struct epoll_event connEv = {};
+            connEv.events = EPOLLIN;
+            connEv.data.ptr = c;
+            if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &connEv) == -1)
+                delete c;
+        }
+    }
+    close(epoll);
+}
+
+static int
+unixSocket(const char *path, struct sockaddr_un &addr)
+{
+    if (strlen(path) >= sizeof addr.sun_path) {
+        clog << "socket path too long: " << path << endl;
+        return -1;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        clog << "socket: " << strerror(errno) << endl;
+    return fd;
+}
+
+}
+
+bool
+serve(const char *path, unsigned threads)
+{
+    struct sockaddr_un addr;
+    int listener = unixSocket(path, addr);
+    if (listener == -1)
+        return false;
+    // Remove a stale socket from an earlier run, but nothing else.
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            clog << "not replacing " << path << ": it isn't a socket" << endl;
+            close(listener);
+            return false;
+        }
+        unlink(path);
+    }
+    if (bind(listener, reinterpret_cast<struct sockaddr *>(&addr), sizeof addr) == -1
+            || listen(listener, SOMAXCONN) == -1) {
+        clog << "failed to listen on " << path << ": " << strerror(errno) << endl;
+        close(listener);
+        return false;
+    }
+    signal(SIGPIPE, SIG_IGN); // clients going away show up as write errors.
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+    runThreads(max(threads, 1U), [listener] (unsigned) -> void {
+        eventLoop(listener);
+    });
+    close(listener);
+    return false;
+}
+
+bool
+client(const char *path, const Inputs &inputs, ostream &out, bool floats)
+{
+    struct sockaddr_un addr;
+    int fd = unixSocket(path, addr);
+    if (fd == -1)
+        return false;
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof addr) == -1) {
+        clog << "failed to connect to " << path << ": " << strerror(errno) << endl;
+        close(fd);
+        return false;
+    }
+    bool good = true;
+    string payload, reply;
+    good = forEachInput(inputs, [&] (istream &in, const char *name) -> void {
+        payload.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        uint32_t header[2];
+        if (!writeMessage(fd, floats ? ParseFloats : 0, payload)
+                || !readFully(fd, header, sizeof header)) {
+            clog << name << ": lost connection to server" << endl;
+            good = false;
+            return;
+        }
+        reply.resize(header[1]);
+        if (!readFully(fd, &reply[0], reply.size())) {
+            clog << name << ": lost connection to server" << endl;
+            good = false;
+            return;
+        }
+        if (header[0] == ReplyOK) {
+            out << reply;
+        } else {
+            cerr << name << ": " << (header[0] == ReplyInvalid ? "invalid JSON: " : "") << reply << endl;
+            good = false;
+        }
+    }) && good;
+    out.flush();
+    close(fd);
+    return good;
+}
@@ -0,0 +1,129 @@
+// Find the records with the largest values of a numeric field in one pass.
+#include <jdent.h>
+#include <path.h>
+#include <pull.h>
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <iostream>
+
+using namespace JSON;
+using namespace std;
+
+namespace {
+
+struct Ranked {
+    double key;
+    unsigned long seq;
+    string raw;
+};
+
+/*
+ * Heap order: the root is the record we'd evict first - the smallest key, or
+ * for equal keys, the one we saw last.
+ */
+static bool
+evictFirst(const Ranked &a, const Ranked &b)
+{
+    return a.key > b.key || (a.key == b.key && a.seq < b.seq);
+}
+
+class TopK {
+    size_t k;
+    unsigned long seq;
+    vector<Ranked> heap;
+public:
+    TopK(size_t k_) : k(k_), seq(0) { heap.reserve(k); }
+
+    // Offer a record; if we keep it, we take over its buffer.
+    void offer(double key, string &raw) {
+        ++seq;
+        if (heap.size() < k) {
+            heap.push_back(Ranked{ key, seq, string() });
+            heap.back().raw.swap(raw);
+            push_heap(heap.begin(), heap.end(), evictFirst);
+        } else if (k != 0 && key > heap.front().key) {
+            pop_heap(heap.begin(), heap.end(), evictFirst);
+            Ranked &slot = heap.back();
+            slot.key = key;
+            slot.seq = seq;
+            slot.raw.swap(raw);
+            push_heap(heap.begin(), heap.end(), evictFirst);
+        }
+    }
+
+    // The surviving records, largest key first.
+    vector<Ranked> &sorted() {
+        sort_heap(heap.begin(), heap.end(), evictFirst);
+        return heap;
+    }
+};
+
+/*
+ * Look through the value "event" starts for numbers on the path below
+ * "node", skipping anything off it. If several
+ * match, the last one wins. Returns false if the value is invalid.
+ */
+static bool
+findKey(PullParser &parser, const Event &event, const PathTrie::Node &node, double &key, bool &found)
+{
+    if (node.leaf != -1) {
+        if (event.type == EventType::Number) {
+            auto text = event.text;
+            if (from_chars(text.data(), text.data() + text.size(), key).ec != errc())
+                key = strtod(string(text).c_str(), 0); // overflow to infinity, or underflow to 0.
+            found = true;
+        }
+        return parser.skip();
+    }
+    Event e;
+    if (event.type == EventType::BeginObject) {
+        while (parser.next(e) && e.type == EventType::Key) {
+            const PathTrie::Node *child = node.child(string(e.text));
+            if (!(child ? parser.next(e) && findKey(parser, e, *child, key, found) : parser.skip()))
+                return false;
+        }
+    } else if (event.type == EventType::BeginArray) {
+        for (size_t idx = 0; parser.next(e) && e.type != EventType::EndArray; ++idx) {
+            const PathTrie::Node *child = node.child(to_string(idx));
+            if (!(child ? findKey(parser, e, *child, key, found) : parser.skip()))
+                return false;
+        }
+    }
+    return !parser.failed();
+}
+
+}
+
+bool
+topRecords(const Inputs &inputs, ostream &out, size_t k, const string &path)
+{
+    PathTrie trie;
+    trie.add(path);
+    TopK top(k);
+    bool good = true;
+
+    good = forEachInput(inputs, [&] (istream &in, const char *name) -> void {
+        unsigned long lineno = 0;
+        forEachRecord(in, [&] (string &line) -> void {
+            ++lineno;
+            bool found = false;
+            double key = 0;
+            PullParser parser(line);
+            Event event;
+            // A record that fails on its first token is as bad as one failing later.
+            if (parser.next(event) ? !findKey(parser, event, trie.root, key, found) : parser.failed()) {
+                cerr << name << ":" << lineno << ": invalid JSON: " << parser.error().message() << endl;
+                good = false;
+                return;
+            }
+            if (found)
+                top.offer(key, line);
+        });
+    }) && good;
+
+    for (auto &ranked : top.sorted())
+        out << ranked.raw << "\n";
+    out.flush();
+    return good;
+}